@@ -0,0 +1,494 @@
+// Contains the offline batch mode that re-merges and re-fuses archived brackets from disk.
+
+#ifndef INCLUDED_BATCHPROCESSOR_H_7719254
+#define INCLUDED_BATCHPROCESSOR_H_7719254
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "opencv2/opencv.hpp"
+#include "ExposureFusion.h"
+#include "Frame.h"
+#include "HdrMerge.h"
+#include "HdrWriter.h"
+#include "WorkStealingPool.h"
+
+namespace Pipeline
+{
+    struct SBatchOptions
+    {
+        SBatchOptions()
+            : cameraGamma( 0.46)
+            , threadCount( 0)
+            , readAhead( 0)
+            , format( c_defaultHdrFormat)
+        {
+        }
+
+        // Exposure time of every sequence set in set index order, as in live capture.
+        std::vector<double> exposureTimesUs;
+        double cameraGamma;
+        // 0 uses all cores.
+        size_t threadCount;
+        // Brackets decoded or processed at the same time; 0 means twice the thread count.
+        // The files of the brackets after those are prefetched by the kernel.
+        size_t readAhead;
+        EHdrFormat format;
+    };
+
+    // One bracket found on disk.
+    struct SBatchBracket
+    {
+        // Identifies the bracket in the progress log: its output path relative to the output directory.
+        std::string key;
+        std::vector<std::string> paths;
+        std::string outputBase;
+    };
+
+    // Finds the image_NNNNN files that CImageEventPrinter writes in a directory tree and
+    // processes them like the bracket worker does live: a half-float radiance map and a
+    // fused image per bracket, mirrored into the output tree. The sequence set of each frame
+    // is read from the sets.txt next to it; frames that change detection did not save are
+    // taken from the image unchanged.txt names for them. A bracket is a run of consecutive
+    // frame numbers with sets 0, 1, ..., so a frame lost during capture leaves its bracket
+    // incomplete instead of shifting every later one. Incomplete brackets are left out, as
+    // are brackets with a frame that roi.txt lists as saved cropped. Recordings without
+    // sets.txt fall back to frame n belonging to set n % sets.
+    //
+    // The outputs are frames_NNNNN.exr (or .hdr) and fused_frames_NNNNN.jpg, where NNNNN is
+    // the frame number of the bracket's set 0 image. They deliberately do not reuse the
+    // bracket_NNNNN and fused_NNNNN names of live capture: its bracket counter only counts
+    // the brackets it merged, and it skips those it dropped while the worker was behind,
+    // which cannot be told from the recording.
+    //
+    // Brackets are tasks on a work-stealing pool. Within a bracket, decoding the frames,
+    // merging and fusing run as subtasks, and the merge's row bands and the fusion's row
+    // work are split further into subtasks of their own, so idle workers steal rows of a
+    // large frame when there are few brackets left. OpenCV's own threads are turned off for
+    // the run: the pool already keeps every core busy, and cv::parallel_for_ on top of it
+    // would oversubscribe the CPU. Finished brackets are appended to progress.log in the
+    // output directory and skipped when a run is repeated, so an interrupted job resumes
+    // where it stopped.
+    class CBatchProcessor
+    {
+    public:
+        explicit CBatchProcessor( const SBatchOptions& options)
+            : m_options( options)
+        {
+            CV_Assert( !options.exposureTimesUs.empty());
+        }
+
+        std::vector<SBatchBracket> Scan( const std::string& inputDirectory, const std::string& outputDirectory) const
+        {
+            std::vector<SBatchBracket> brackets;
+            ScanDirectory( inputDirectory, "", outputDirectory, brackets);
+            return brackets;
+        }
+
+        // Returns the number of brackets that failed; they are retried by the next run.
+        size_t Run( const std::string& inputDirectory, const std::string& outputDirectory)
+        {
+            const std::vector<SBatchBracket> all = Scan( inputDirectory, outputDirectory);
+            const std::string logPath = outputDirectory + "/progress.log";
+            const std::set<std::string> done = ReadProgress( logPath);
+            std::vector<SBatchBracket> brackets;
+            for (size_t i = 0; i < all.size(); ++i)
+            {
+                if (!done.count( all[i].key))
+                {
+                    brackets.push_back( all[i]);
+                }
+            }
+            std::cout << all.size() << " brackets found, " << all.size() - brackets.size() << " already done." << std::endl;
+
+            MakeDirectories( outputDirectory);
+            FILE* log = std::fopen( logPath.c_str(), "a");
+            if (!log)
+            {
+                std::cerr << "Cannot write " << logPath << std::endl;
+                return brackets.size();
+            }
+
+            const size_t threadCount = m_options.threadCount ? m_options.threadCount : std::max( 1u, std::thread::hardware_concurrency());
+            const size_t readAhead = m_options.readAhead ? m_options.readAhead : 2 * threadCount;
+            const int openCvThreads = cv::getNumThreads();
+            cv::setNumThreads( 1);
+            CWorkStealingPool pool( threadCount);
+            std::atomic<size_t> inFlight( 0);
+            std::atomic<size_t> finished( 0);
+            std::atomic<size_t> failed( 0);
+            std::mutex logMutex;
+            {
+                CTaskGroup group( pool);
+                for (size_t i = 0; i < brackets.size(); ++i)
+                {
+                    // The submitting thread helps out while the window is full.
+                    while (inFlight.load() >= readAhead)
+                    {
+                        if (!pool.RunOne())
+                        {
+                            pool.WaitFor( [&inFlight, readAhead]() { return inFlight.load() < readAhead; });
+                        }
+                    }
+                    if (i + readAhead < brackets.size())
+                    {
+                        Prefetch( brackets[i + readAhead]);
+                    }
+                    ++inFlight;
+                    const SBatchBracket* bracket = &brackets[i];
+                    group.Run( [this, bracket, &pool, &inFlight, &finished, &failed, &logMutex, log, &brackets]()
+                    {
+                        const bool ok = Process( *bracket, pool);
+                        {
+                            std::lock_guard<std::mutex> lock( logMutex);
+                            if (ok)
+                            {
+                                std::fprintf( log, "%s\n", bracket->key.c_str());
+                                std::fflush( log);
+                            }
+                            else
+                            {
+                                ++failed;
+                                std::cerr << "Failed: " << bracket->key << std::endl;
+                            }
+                            const size_t count = ++finished;
+                            if (count % 100 == 0 || count == brackets.size())
+                            {
+                                std::cout << count << "/" << brackets.size() << " brackets processed" << std::endl;
+                            }
+                        }
+                        --inFlight;
+                        pool.NotifyAll();
+                    });
+                }
+            }
+            cv::setNumThreads( openCvThreads);
+            std::fclose( log);
+            return failed.load();
+        }
+
+    private:
+        // Rows per subtask of the fusion's row work; the merge splits by its own bands.
+        static const int c_rowsPerTask = CHdrMerge::c_tileSize;
+
+        bool Process( const SBatchBracket& bracket, CWorkStealingPool& pool)
+        {
+            const size_t sets = m_options.exposureTimesUs.size();
+            std::vector<cv::Mat> images( sets);
+            {
+                CTaskGroup decode( pool);
+                for (size_t i = 0; i < sets; ++i)
+                {
+                    decode.Run( [&images, &bracket, i]()
+                    {
+                        images[i] = cv::imread( bracket.paths[i], cv::IMREAD_GRAYSCALE);
+                    });
+                }
+            }
+            CBracket frames( sets);
+            for (size_t i = 0; i < sets; ++i)
+            {
+                if (images[i].empty() || images[i].size() != images[0].size())
+                {
+                    return false;
+                }
+                frames[i] = WrapFrame( images[i], m_pool);
+                frames[i]->setIndex = (int) i;
+                frames[i]->exposureUs = m_options.exposureTimesUs[i];
+            }
+
+            const size_t slash = bracket.outputBase.rfind( '/');
+            if (slash != std::string::npos)
+            {
+                MakeDirectories( bracket.outputBase.substr( 0, slash));
+            }
+            std::atomic<bool> merged( false);
+            std::atomic<bool> fused( false);
+            {
+                CTaskGroup stages( pool);
+                stages.Run( [this, &frames, &bracket, &merged, &pool]()
+                {
+                    CHdrMerge merge( m_options.cameraGamma);
+                    cv::Mat radiance;
+                    merge.Prepare( frames, radiance);
+                    RunRows( pool, cv::Range( 0, CHdrMerge::BandCount( frames)), 1, [&merge, &frames, &radiance]( const cv::Range& bands)
+                    {
+                        merge.MergeBands( frames, radiance, bands);
+                    });
+                    merged = m_options.format == HdrFormat_OpenExr
+                        ? WriteOpenExr( bracket.outputBase + ".exr", radiance, 1)
+                        : WriteRadianceHdr( bracket.outputBase + ".hdr", radiance);
+                });
+                stages.Run( [&frames, &bracket, &fused, &pool]()
+                {
+                    CExposureFusion fusion;
+                    fusion.SetRowRunner( [&pool]( const cv::Range& rows, const std::function<void( const cv::Range&)>& body)
+                    {
+                        RunRows( pool, rows, c_rowsPerTask, body);
+                    });
+                    cv::Mat image;
+                    fusion.Fuse( frames, image);
+                    fused = cv::imwrite( FusedPath( bracket.outputBase), image);
+                });
+            }
+            return merged && fused;
+        }
+
+        // Runs body over range in pieces of step as subtasks, so that idle workers steal the
+        // rows of a large frame instead of one worker doing the whole stage.
+        static void RunRows( CWorkStealingPool& pool, const cv::Range& range, int step, const std::function<void( const cv::Range&)>& body)
+        {
+            CTaskGroup rows( pool);
+            for (int start = range.start; start < range.end; start += step)
+            {
+                const cv::Range piece( start, std::min( start + step, range.end));
+                rows.Run( [&body, piece]()
+                {
+                    body( piece);
+                });
+            }
+        }
+
+        // frames_NNNNN -> fused_frames_NNNNN.jpg
+        static std::string FusedPath( const std::string& outputBase)
+        {
+            const size_t slash = outputBase.rfind( '/');
+            const std::string directory = slash == std::string::npos ? "" : outputBase.substr( 0, slash + 1);
+            return directory + "fused_" + outputBase.substr( directory.size()) + ".jpg";
+        }
+
+        // Lets the kernel start reading the files while earlier brackets are processed.
+        static void Prefetch( const SBatchBracket& bracket)
+        {
+            for (size_t i = 0; i < bracket.paths.size(); ++i)
+            {
+                int fd = open( bracket.paths[i].c_str(), O_RDONLY);
+                if (fd >= 0)
+                {
+                    posix_fadvise( fd, 0, 0, POSIX_FADV_WILLNEED);
+                    close( fd);
+                }
+            }
+        }
+
+        static std::set<std::string> ReadProgress( const std::string& path)
+        {
+            std::set<std::string> done;
+            std::ifstream log( path.c_str());
+            std::string line;
+            while (std::getline( log, line))
+            {
+                if (!line.empty())
+                {
+                    done.insert( line);
+                }
+            }
+            return done;
+        }
+
+        static void MakeDirectories( const std::string& path)
+        {
+            for (size_t slash = path.find( '/', 1); ; slash = path.find( '/', slash + 1))
+            {
+                mkdir( path.substr( 0, slash).c_str(), 0755);
+                if (slash == std::string::npos)
+                {
+                    return;
+                }
+            }
+        }
+
+        // Returns the frame number of "image_<number>.<ext>", or -1.
+        static long long FrameNumber( const std::string& name)
+        {
+            static const char* const prefix = "image_";
+            const size_t dot = name.rfind( '.');
+            if (name.compare( 0, 6, prefix) != 0 || dot == std::string::npos || dot <= 6)
+            {
+                return -1;
+            }
+            const std::string extension = name.substr( dot + 1);
+            if (extension != "jpg" && extension != "png" && extension != "bmp" && extension != "tif")
+            {
+                return -1;
+            }
+            long long number = 0;
+            for (size_t i = 6; i < dot; ++i)
+            {
+                if (name[i] < '0' || name[i] > '9')
+                {
+                    return -1;
+                }
+                number = number * 10 + (name[i] - '0');
+            }
+            return number;
+        }
+
+        // A line "image_<number> set <set> ... [unchanged from image_<source>]" of a log that
+        // CImageEventPrinter writes next to the images.
+        struct SLoggedFrame
+        {
+            int setIndex;
+            long long source;
+        };
+
+        static std::map<long long, SLoggedFrame> ReadFrameLog( const std::string& path)
+        {
+            std::map<long long, SLoggedFrame> frames;
+            std::ifstream log( path.c_str());
+            std::string line;
+            while (std::getline( log, line))
+            {
+                std::istringstream fields( line);
+                std::string name;
+                std::string keyword;
+                SLoggedFrame frame = { -1, -1 };
+                if (!(fields >> name >> keyword >> frame.setIndex) || keyword != "set")
+                {
+                    continue;
+                }
+                while (fields >> keyword)
+                {
+                    if (keyword == "from" && fields >> keyword)
+                    {
+                        frame.source = FrameNumber( keyword + ".jpg");
+                    }
+                }
+                const long long number = FrameNumber( name + ".jpg");
+                if (number >= 0)
+                {
+                    frames[number] = frame;
+                }
+            }
+            return frames;
+        }
+
+        // The sequence set of a frame and the file that holds its pixels.
+        struct SRecordedFrame
+        {
+            int setIndex;
+            std::string path;
+        };
+
+        void ScanDirectory( const std::string& root, const std::string& relative, const std::string& outputDirectory, std::vector<SBatchBracket>& brackets) const
+        {
+            const std::string directory = relative.empty() ? root : root + "/" + relative;
+            DIR* handle = opendir( directory.c_str());
+            if (!handle)
+            {
+                return;
+            }
+            std::vector<std::string> subdirectories;
+            std::map<long long, std::string> files;
+            while (dirent* entry = readdir( handle))
+            {
+                const std::string name = entry->d_name;
+                if (name == "." || name == "..")
+                {
+                    continue;
+                }
+                struct stat status;
+                if (stat( (directory + "/" + name).c_str(), &status) != 0)
+                {
+                    continue;
+                }
+                if (S_ISDIR( status.st_mode))
+                {
+                    subdirectories.push_back( relative.empty() ? name : relative + "/" + name);
+                }
+                else if (FrameNumber( name) >= 0)
+                {
+                    files[FrameNumber( name)] = directory + "/" + name;
+                }
+            }
+            closedir( handle);
+
+            const long long sets = (long long) m_options.exposureTimesUs.size();
+            const std::map<long long, SLoggedFrame> saved = ReadFrameLog( directory + "/sets.txt");
+            const std::map<long long, SLoggedFrame> unchanged = ReadFrameLog( directory + "/unchanged.txt");
+            const std::map<long long, SLoggedFrame> cropped = ReadFrameLog( directory + "/roi.txt");
+            std::map<long long, SRecordedFrame> recorded;
+            for (std::map<long long, std::string>::const_iterator it = files.begin(); it != files.end(); ++it)
+            {
+                if (cropped.count( it->first))
+                {
+                    continue;
+                }
+                SRecordedFrame frame = { (int) (it->first % sets), it->second };
+                if (!saved.empty())
+                {
+                    std::map<long long, SLoggedFrame>::const_iterator logged = saved.find( it->first);
+                    if (logged == saved.end())
+                    {
+                        continue;
+                    }
+                    frame.setIndex = logged->second.setIndex;
+                }
+                recorded[it->first] = frame;
+            }
+            for (std::map<long long, SLoggedFrame>::const_iterator it = unchanged.begin(); it != unchanged.end(); ++it)
+            {
+                std::map<long long, SRecordedFrame>::const_iterator source = recorded.find( it->second.source);
+                if (source != recorded.end() && source->second.setIndex == it->second.setIndex)
+                {
+                    recorded[it->first] = source->second;
+                }
+            }
+
+            for (std::map<long long, SRecordedFrame>::const_iterator it = recorded.begin(); it != recorded.end(); ++it)
+            {
+                if (it->second.setIndex != 0)
+                {
+                    continue;
+                }
+                SBatchBracket bracket;
+                for (long long s = 0; s < sets; ++s)
+                {
+                    std::map<long long, SRecordedFrame>::const_iterator frame = recorded.find( it->first + s);
+                    if (frame == recorded.end() || frame->second.setIndex != s)
+                    {
+                        break;
+                    }
+                    bracket.paths.push_back( frame->second.path);
+                }
+                if ((long long) bracket.paths.size() != sets)
+                {
+                    continue;
+                }
+                std::stringstream key;
+                key << (relative.empty() ? "" : relative + "/") << "frames_" << std::setfill('0') << std::setw(5) << it->first;
+                bracket.key = key.str();
+                bracket.outputBase = outputDirectory + "/" + bracket.key;
+                brackets.push_back( bracket);
+            }
+
+            std::sort( subdirectories.begin(), subdirectories.end());
+            for (size_t i = 0; i < subdirectories.size(); ++i)
+            {
+                ScanDirectory( root, subdirectories[i], outputDirectory, brackets);
+            }
+        }
+
+        SBatchOptions m_options;
+        CMatPool m_pool;
+    };
+}
+
+#endif /* INCLUDED_BATCHPROCESSOR_H_7719254 */
@@ -0,0 +1,100 @@
+// Contains a bounded multi-producer multi-consumer queue used to hand work to background threads.
+
+#ifndef INCLUDED_BLOCKINGQUEUE_H_3391207
+#define INCLUDED_BLOCKINGQUEUE_H_3391207
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+namespace Pipeline
+{
+    template <typename T>
+    class CBlockingQueue
+    {
+    public:
+        explicit CBlockingQueue( size_t capacity)
+            : m_capacity( capacity)
+            , m_closed( false)
+        {
+        }
+
+        // Never blocks; returns false if the queue is full or closed so that the
+        // caller (usually the grab thread) can decide what to drop.
+        bool TryPush( const T& item)
+        {
+            {
+                std::lock_guard<std::mutex> lock( m_mutex);
+                if (m_closed || m_items.size() >= m_capacity)
+                {
+                    return false;
+                }
+                m_items.push_back( item);
+            }
+            m_notEmpty.notify_one();
+            return true;
+        }
+
+        // Blocks while the queue is full. Returns false if the queue was closed.
+        bool Push( const T& item)
+        {
+            {
+                std::unique_lock<std::mutex> lock( m_mutex);
+                m_notFull.wait( lock, [this] { return m_closed || m_items.size() < m_capacity; });
+                if (m_closed)
+                {
+                    return false;
+                }
+                m_items.push_back( item);
+            }
+            m_notEmpty.notify_one();
+            return true;
+        }
+
+        // Blocks until an item is available. Returns false once the queue is closed and drained.
+        bool Pop( T& item)
+        {
+            {
+                std::unique_lock<std::mutex> lock( m_mutex);
+                m_notEmpty.wait( lock, [this] { return m_closed || !m_items.empty(); });
+                if (m_items.empty())
+                {
+                    return false;
+                }
+                item = m_items.front();
+                m_items.pop_front();
+            }
+            m_notFull.notify_one();
+            return true;
+        }
+
+        void Close()
+        {
+            {
+                std::lock_guard<std::mutex> lock( m_mutex);
+                m_closed = true;
+            }
+            m_notEmpty.notify_all();
+            m_notFull.notify_all();
+        }
+
+        size_t Size() const
+        {
+            std::lock_guard<std::mutex> lock( m_mutex);
+            return m_items.size();
+        }
+
+    private:
+        CBlockingQueue( const CBlockingQueue&);
+        CBlockingQueue& operator=( const CBlockingQueue&);
+
+        const size_t m_capacity;
+        bool m_closed;
+        std::deque<T> m_items;
+        mutable std::mutex m_mutex;
+        std::condition_variable m_notEmpty;
+        std::condition_variable m_notFull;
+    };
+}
+
+#endif /* INCLUDED_BLOCKINGQUEUE_H_3391207 */
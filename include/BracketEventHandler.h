@@ -0,0 +1,434 @@
+// Contains an Image Event Handler that collects the frames of one sequencer cycle into an
+// exposure bracket and processes complete brackets on a background thread.
+
+#ifndef INCLUDED_BRACKETEVENTHANDLER_H_2957714
+#define INCLUDED_BRACKETEVENTHANDLER_H_2957714
+
+#include <pylon/PylonIncludes.h>
+#include <pylon/ImageEventHandler.h>
+#include <pylon/GrabResultPtr.h>
+#include <pylon/ImageFormatConverter.h>
+#include <atomic>
+#include <cstring>
+#include <memory>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "opencv2/opencv.hpp"
+#include "BlockingQueue.h"
+#include "DeadlineScheduler.h"
+#include "DefectPixelMap.h"
+#include "ExposureFusion.h"
+#include "FlatFieldCorrection.h"
+#include "Frame.h"
+#include "HdrMerge.h"
+#include "HdrWriter.h"
+#include "SharedFramePublisher.h"
+#include "TemporalDenoiser.h"
+#include "Undistortion.h"
+#include "Metrics.h"
+
+namespace Pylon
+{
+    class CInstantCamera;
+
+    class CBracketEventHandler : public CImageEventHandler
+    {
+    public:
+        // exposureTimesUs holds the exposure time of every sequence set in set index order,
+        // cameraGamma the value of the camera's Gamma feature.
+        CBracketEventHandler( const std::vector<double>& exposureTimesUs, double cameraGamma, const std::string& outputDirectory = "frames")
+            : m_exposureTimesUs( exposureTimesUs)
+            , m_outputDirectory( outputDirectory)
+            , m_pending( exposureTimesUs.size())
+            , m_nextSetIndex( 0)
+            , m_frameNumber( 0)
+            , m_bracketNumber( 0)
+            , m_calibrator( exposureTimesUs.size())
+            , m_denoiser( exposureTimesUs.size())
+            , m_denoiseRequested( true)
+            , m_denoiseEnabled( true)
+            , m_scheduler( 0)
+            , m_bracketScheduler( 0)
+            , m_mergeStage( m_bracketScheduler.AddStage( "merge", Pipeline::StagePriority_MustRun))
+            , m_fusionStage( m_bracketScheduler.AddStage( "fusion", Pipeline::StagePriority_BestEffort))
+            , m_merge( cameraGamma)
+            , m_publisher( 0)
+            , m_brackets( 2)
+        {
+            m_worker = std::thread( &CBracketEventHandler::ProcessBrackets, this);
+        }
+
+        virtual ~CBracketEventHandler()
+        {
+            m_brackets.Close();
+            m_worker.join();
+        }
+
+        // Consumers are called on the grab thread with every successfully grabbed frame and
+        // must stay alive while the camera is grabbing.
+        void AddFrameConsumer( Pipeline::IFrameConsumer* consumer)
+        {
+            m_consumers.push_back( consumer);
+        }
+
+        // Publishes the radiance map and the fused image of every bracket. Set it before grabbing
+        // starts; the publisher must outlive this handler.
+        void SetSharedFramePublisher( Pipeline::CSharedFramePublisher* publisher)
+        {
+            m_publisher = publisher;
+        }
+
+        // scheduler times the grab thread, whose frames this handler starts; the consumers
+        // register their stages with it. The bracket worker gets a budget of one frame deadline
+        // per sequence set, in which merging always runs and fusion only if there is time.
+        // Set it before grabbing starts.
+        void SetScheduler( Pipeline::CDeadlineScheduler* scheduler)
+        {
+            m_scheduler = scheduler;
+            m_bracketScheduler.SetFrameDeadline( scheduler->FrameDeadline() * m_pending.size());
+        }
+
+        // Starts over at sequence set 0, e.g. after the sequencer was reconfigured. Call only
+        // while the camera is not grabbing.
+        void ResetSequence()
+        {
+            m_nextSetIndex = 0;
+            DiscardPending();
+            m_denoiser.Reset();
+        }
+
+        // Averages every sequence set over consecutive brackets before anything else sees the frame.
+        // May be called while grabbing; the grab thread applies it, and starts the averages
+        // over, with the next frame.
+        void EnableTemporalDenoise( bool enable)
+        {
+            m_denoiseRequested.store( enable);
+        }
+
+        // Loads camera intrinsics and undistorts every frame before the consumers see it.
+        // With rois, only the tiles covering them are remapped. Call before grabbing starts.
+        bool LoadUndistortion( const std::string& intrinsicsPath, const std::vector<cv::Rect>& rois = std::vector<cv::Rect>())
+        {
+            m_undistortion = Pipeline::CUndistortion::Load( intrinsicsPath);
+            m_undistortionRois = rois;
+            return (bool) m_undistortion;
+        }
+
+        // Records raw frames of every sequence set for dark or flat field calibration.
+        // Correction is suspended while recording.
+        void StartCalibration( Pipeline::ECalibrationMode mode, int framesPerSet)
+        {
+            m_calibrator.Start( mode, framesPerSet);
+        }
+
+        bool IsCalibrating() const
+        {
+            return m_calibrator.IsRecording();
+        }
+
+        // Builds the flat field tables and the defect pixel map from the recorded frames,
+        // saves them and applies them to all following frames.
+        bool FinishCalibration( const std::string& flatFieldPath, const std::string& defectMapPath)
+        {
+            std::shared_ptr<const Pipeline::CFlatFieldCorrection> correction = m_calibrator.Build();
+            std::shared_ptr<const Pipeline::CDefectPixelMap> defects = Pipeline::CDefectPixelMap::Detect( m_calibrator);
+            if (!correction || !defects)
+            {
+                return false;
+            }
+            std::atomic_store( &m_flatField, correction);
+            std::atomic_store( &m_defects, defects);
+            return correction->Save( flatFieldPath) && defects->Save( defectMapPath);
+        }
+
+        // The flat field tables and the defect map are loaded and applied independently, since
+        // tables saved before defect detection existed come without a map. Each returns true
+        // if its file could be loaded.
+        bool LoadFlatField( const std::string& flatFieldPath)
+        {
+            std::shared_ptr<const Pipeline::CFlatFieldCorrection> correction = Pipeline::CFlatFieldCorrection::Load( flatFieldPath);
+            std::atomic_store( &m_flatField, correction);
+            return (bool) correction;
+        }
+
+        bool LoadDefectMap( const std::string& defectMapPath)
+        {
+            std::shared_ptr<const Pipeline::CDefectPixelMap> defects = Pipeline::CDefectPixelMap::Load( defectMapPath);
+            std::atomic_store( &m_defects, defects);
+            return (bool) defects;
+        }
+
+        virtual void OnImagesSkipped( CInstantCamera& /*camera*/, size_t countOfSkippedImages)
+        {
+            // The sequencer kept advancing for the frames we never saw.
+            m_nextSetIndex = (m_nextSetIndex + countOfSkippedImages) % m_pending.size();
+            DiscardPending();
+            if (m_scheduler)
+            {
+                m_scheduler->ReportOverrun();
+            }
+        }
+
+        virtual void OnImageGrabbed( CInstantCamera& /*camera*/, const CGrabResultPtr& ptrGrabResult)
+        {
+            if (!ptrGrabResult->GrabSucceeded())
+            {
+                // The failed frame still consumed a sequence set.
+                m_nextSetIndex = (m_nextSetIndex + 1) % m_pending.size();
+                DiscardPending();
+                return;
+            }
+
+            if (m_scheduler)
+            {
+                m_scheduler->BeginFrame();
+            }
+            // Counting callbacks only works as long as no frame is lost without one, so the
+            // set the camera reports wins.
+            size_t setIndex = m_nextSetIndex;
+            const int reportedSetIndex = ChunkSequenceSetIndex( ptrGrabResult);
+            if (reportedSetIndex >= 0 && (size_t) reportedSetIndex < m_pending.size() && (size_t) reportedSetIndex != setIndex)
+            {
+                Pipeline::GetMetrics().Add( Pipeline::Counter_SequenceResyncs);
+                DiscardPending();
+                setIndex = (size_t) reportedSetIndex;
+            }
+            m_nextSetIndex = (setIndex + 1) % m_pending.size();
+
+            Pipeline::CFramePtr frame;
+            {
+                Pipeline::CScopedLatency latency( Pipeline::Histogram_StageIngest);
+                frame = Ingest( ptrGrabResult, (int) setIndex);
+            }
+            frame->exposureUs = m_exposureTimesUs[setIndex];
+            if (m_calibrator.IsRecording())
+            {
+                m_calibrator.Accumulate( *frame);
+            }
+            else
+            {
+                std::shared_ptr<const Pipeline::CDefectPixelMap> defects = std::atomic_load( &m_defects);
+                if (defects && defects->Covers( frame->setIndex, frame->image.size()))
+                {
+                    Pipeline::CScopedLatency latency( Pipeline::Histogram_StageDefects);
+                    defects->Correct( frame->setIndex, frame->image);
+                }
+            }
+            const bool denoise = m_denoiseRequested.load();
+            if (denoise != m_denoiseEnabled)
+            {
+                m_denoiseEnabled = denoise;
+                m_denoiser.Reset();
+            }
+            if (m_denoiseEnabled)
+            {
+                Pipeline::CScopedLatency latency( Pipeline::Histogram_StageDenoise);
+                m_denoiser.Apply( *frame);
+            }
+            // Last, since everything before works on sensor pixels.
+            if (m_undistortion && m_undistortion->ImageSize() == frame->image.size())
+            {
+                Pipeline::CScopedLatency latency( Pipeline::Histogram_StageUndistort);
+                m_undistortion->Apply( *frame, m_pool, m_undistortionRois);
+            }
+            for (size_t i = 0; i < m_consumers.size(); ++i)
+            {
+                m_consumers[i]->OnFrame( frame);
+            }
+            m_pending[setIndex] = frame;
+
+            if (setIndex + 1 == m_pending.size())
+            {
+                for (size_t i = 0; i < m_pending.size(); ++i)
+                {
+                    if (!m_pending[i])
+                    {
+                        // Incomplete bracket, e.g. right after a skip.
+                        DiscardPending();
+                        return;
+                    }
+                }
+                // Never block the grab thread; drop the bracket if the worker is behind.
+                if (!m_brackets.TryPush( m_pending))
+                {
+                    Pipeline::GetMetrics().Add( Pipeline::Counter_BracketsDropped);
+                    m_bracketScheduler.ReportOverrun();
+                }
+                Pipeline::GetMetrics().Set( Pipeline::Gauge_BracketQueueDepth, (int64_t) m_brackets.Size());
+                DiscardPending();
+            }
+        }
+
+    private:
+        // The sequence set from the frame's chunk data, or -1 if the camera does not send the
+        // SequenceSetIndex chunk (see main.cpp).
+        static int ChunkSequenceSetIndex( const CGrabResultPtr& ptrGrabResult)
+        {
+            if (!ptrGrabResult->IsChunkDataAvailable())
+            {
+                return -1;
+            }
+            GenApi::CIntegerPtr index( ptrGrabResult->GetChunkDataNodeMap().GetNode( "ChunkSequenceSetIndex"));
+            return IsReadable( index) ? (int) index->GetValue() : -1;
+        }
+
+        // Copies the grab buffer into a pooled Mono8 frame so the pylon buffer can be requeued.
+        // The flat field correction is applied during that copy, so it costs no extra pass.
+        Pipeline::CFramePtr Ingest( const CGrabResultPtr& ptrGrabResult, int setIndex)
+        {
+            const int width = (int) ptrGrabResult->GetWidth();
+            const int height = (int) ptrGrabResult->GetHeight();
+            Pipeline::CFramePtr frame = Pipeline::AcquireFrame( m_pool, height, width, CV_8UC1);
+            frame->frameNumber = m_frameNumber++;
+            frame->setIndex = setIndex;
+            frame->timestamp = ptrGrabResult->GetTimeStamp();
+
+            std::shared_ptr<const Pipeline::CFlatFieldCorrection> flatField = std::atomic_load( &m_flatField);
+            if (flatField && (m_calibrator.IsRecording() || !flatField->Covers( setIndex, frame->image.size())))
+            {
+                flatField.reset();
+            }
+
+            if (ptrGrabResult->GetPixelType() == PixelType_Mono8)
+            {
+                const size_t sourceStride = (size_t) width + ptrGrabResult->GetPaddingX();
+                const uint8_t* source = (const uint8_t*) ptrGrabResult->GetBuffer();
+                if (flatField)
+                {
+                    flatField->Correct( setIndex, source, sourceStride, frame->image);
+                }
+                else
+                {
+                    for (int y = 0; y < height; ++y)
+                    {
+                        std::memcpy( frame->image.ptr<uint8_t>( y), source + y * sourceStride, (size_t) width);
+                    }
+                }
+            }
+            else
+            {
+                m_converter.OutputPixelFormat = PixelType_Mono8;
+                m_converter.Convert( frame->image.data, frame->image.total(), ptrGrabResult);
+                if (flatField)
+                {
+                    flatField->Correct( setIndex, frame->image);
+                }
+            }
+            return frame;
+        }
+
+        void DiscardPending()
+        {
+            for (size_t i = 0; i < m_pending.size(); ++i)
+            {
+                m_pending[i].reset();
+            }
+        }
+
+        void ProcessBrackets()
+        {
+            Pipeline::CBracket bracket;
+            while (m_brackets.Pop( bracket))
+            {
+                // Read per bracket; the queue orders it after SetScheduler.
+                Pipeline::CDeadlineScheduler* scheduler = m_scheduler ? &m_bracketScheduler : 0;
+                if (scheduler)
+                {
+                    scheduler->BeginFrame();
+                }
+                std::stringstream basePath;
+                basePath << m_outputDirectory << "/bracket_" << std::setfill('0') << std::setw(5) << m_bracketNumber;
+                const cv::Size frameSize = bracket[0]->image.size();
+                const int frameType = bracket[0]->image.type();
+                const uint64_t timestamp = bracket[0]->timestamp;
+
+                {
+                    Pipeline::CScheduledStage stage( scheduler, m_mergeStage);
+                    // The merge writes half floats straight into a pooled buffer that the HDR
+                    // writer holds on to until the file is on disk.
+                    Pipeline::CFramePtr radiance = Pipeline::AcquireFrame( m_pool, frameSize.height, frameSize.width, CV_16UC1);
+                    radiance->frameNumber = m_bracketNumber;
+                    radiance->setIndex = -1;
+                    radiance->timestamp = timestamp;
+                    {
+                        Pipeline::CScopedLatency latency( Pipeline::Histogram_StageMerge);
+                        m_merge.Merge( bracket, radiance->image);
+                    }
+                    m_hdrWriter.Write( radiance, basePath.str());
+                    if (m_publisher)
+                    {
+                        m_publisher->Publish( radiance, Pipeline::SharedFrameKind_Radiance);
+                    }
+                }
+
+                Pipeline::CScheduledStage stage( scheduler, m_fusionStage);
+                if (stage.Run())
+                {
+                    // Pooled as well, so the shared memory publisher can hold on to it.
+                    Pipeline::CFramePtr fused = Pipeline::AcquireFrame( m_pool, frameSize.height, frameSize.width, frameType);
+                    fused->frameNumber = m_bracketNumber;
+                    fused->setIndex = -1;
+                    fused->timestamp = timestamp;
+                    {
+                        Pipeline::CScopedLatency latency( Pipeline::Histogram_StageFusion);
+                        m_fusion.Fuse( bracket, fused->image);
+                    }
+                    // Drop the references before encoding so the frames return to the pool early.
+                    bracket.clear();
+                    if (m_publisher)
+                    {
+                        m_publisher->Publish( fused, Pipeline::SharedFrameKind_Fused);
+                    }
+
+                    std::stringstream path;
+                    path << m_outputDirectory << "/fused_" << std::setfill('0') << std::setw(5) << m_bracketNumber << ".jpg";
+                    if (cv::imwrite( path.str(), fused->image))
+                    {
+                        Pipeline::GetMetrics().Add( Pipeline::Counter_BracketsFused);
+                    }
+                }
+                bracket.clear();
+                ++m_bracketNumber;
+            }
+        }
+
+        std::vector<double> m_exposureTimesUs;
+        std::string m_outputDirectory;
+        Pipeline::CMatPool m_pool;
+        CImageFormatConverter m_converter;
+        std::vector<Pipeline::IFrameConsumer*> m_consumers;
+        // Frames of the bracket currently being grabbed, indexed by sequence set.
+        Pipeline::CBracket m_pending;
+        size_t m_nextSetIndex;
+        uint64_t m_frameNumber;
+        uint64_t m_bracketNumber;
+        Pipeline::CFlatFieldCalibrator m_calibrator;
+        // Swapped atomically by the calibration calls while the grab thread reads them.
+        std::shared_ptr<const Pipeline::CFlatFieldCorrection> m_flatField;
+        std::shared_ptr<const Pipeline::CDefectPixelMap> m_defects;
+        Pipeline::CTemporalDenoiser m_denoiser;
+        std::atomic<bool> m_denoiseRequested;
+        // Only used by the grab thread.
+        bool m_denoiseEnabled;
+        std::shared_ptr<const Pipeline::CUndistortion> m_undistortion;
+        std::vector<cv::Rect> m_undistortionRois;
+
+        Pipeline::CDeadlineScheduler* m_scheduler;
+        // Only used by the worker thread, apart from ReportOverrun.
+        Pipeline::CDeadlineScheduler m_bracketScheduler;
+        int m_mergeStage;
+        int m_fusionStage;
+
+        Pipeline::CHdrMerge m_merge;
+        Pipeline::CExposureFusion m_fusion;
+        Pipeline::CHdrWriter m_hdrWriter;
+        Pipeline::CSharedFramePublisher* m_publisher;
+        Pipeline::CBlockingQueue<Pipeline::CBracket> m_brackets;
+        std::thread m_worker;
+    };
+}
+
+#endif /* INCLUDED_BRACKETEVENTHANDLER_H_2957714 */
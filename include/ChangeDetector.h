@@ -0,0 +1,108 @@
+// Contains a change detector that compares block signatures of frames against the last persisted frame of their sequence set.
+
+#ifndef INCLUDED_CHANGEDETECTOR_H_1849306
+#define INCLUDED_CHANGEDETECTOR_H_1849306
+
+#include <utility>
+#include <vector>
+#include "opencv2/opencv.hpp"
+#include "Frame.h"
+
+namespace Pipeline
+{
+    // Reduces every frame to a small signature of block means (cv::resize with INTER_AREA)
+    // and compares it with the signature of the last persisted frame of the same sequence
+    // set. Both the reduction and the comparison run in vectorized OpenCV kernels, and the
+    // reference is a few kilobytes per set. A frame counts as changed if the blocks differ
+    // by more than meanThreshold grey levels on average or any single block by more than
+    // blockThreshold, so a small object entering the view is not averaged away. Called from
+    // one thread.
+    class CChangeDetector
+    {
+    public:
+        static const int c_signatureWidth = 64;
+        static const int c_signatureHeight = 48;
+
+        // maxUnchangedFrames > 0 reports a frame as changed at least that often per set,
+        // as a keep-alive for consumers of the persisted frames.
+        explicit CChangeDetector( double meanThreshold = 1.0, double blockThreshold = 6.0, int maxUnchangedFrames = 0)
+            : m_meanThreshold( meanThreshold)
+            , m_blockThreshold( blockThreshold)
+            , m_maxUnchangedFrames( maxUnchangedFrames)
+        {
+        }
+
+        // Returns true if the frame differs from the reference of its set. The first frame of
+        // a set, or one of a new size, is always changed. The reference stays until Persisted
+        // is called for a changed frame, so a frame that could not be saved never becomes it.
+        bool Changed( const CFrame& frame)
+        {
+            if (frame.setIndex < 0)
+            {
+                return true;
+            }
+            if ((size_t) frame.setIndex >= m_references.size())
+            {
+                m_references.resize( frame.setIndex + 1);
+            }
+            SReference& reference = m_references[frame.setIndex];
+            cv::resize( frame.image, m_signature, cv::Size( c_signatureWidth, c_signatureHeight), 0, 0, cv::INTER_AREA);
+
+            if (reference.imageSize == frame.image.size() && reference.signature.type() == m_signature.type()
+                && (m_maxUnchangedFrames <= 0 || reference.unchangedFrames < m_maxUnchangedFrames))
+            {
+                const double meanDifference = cv::norm( m_signature, reference.signature, cv::NORM_L1) / m_signature.total() / m_signature.channels();
+                const double blockDifference = cv::norm( m_signature, reference.signature, cv::NORM_INF);
+                if (meanDifference <= m_meanThreshold && blockDifference <= m_blockThreshold)
+                {
+                    ++reference.unchangedFrames;
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        // Makes the frame last passed to Changed, which reported it as changed, the reference
+        // of its set once it has been saved.
+        void Persisted( const CFrame& frame)
+        {
+            if (frame.setIndex < 0 || (size_t) frame.setIndex >= m_references.size())
+            {
+                return;
+            }
+            SReference& reference = m_references[frame.setIndex];
+            std::swap( m_signature, reference.signature);
+            reference.imageSize = frame.image.size();
+            reference.unchangedFrames = 0;
+        }
+
+        void Reset()
+        {
+            m_references.clear();
+        }
+
+    private:
+        CChangeDetector( const CChangeDetector&);
+        CChangeDetector& operator=( const CChangeDetector&);
+
+        struct SReference
+        {
+            SReference()
+                : unchangedFrames( 0)
+            {
+            }
+
+            cv::Mat signature;
+            cv::Size imageSize;
+            int unchangedFrames;
+        };
+
+        double m_meanThreshold;
+        double m_blockThreshold;
+        int m_maxUnchangedFrames;
+        std::vector<SReference> m_references;
+        cv::Mat m_signature;
+    };
+}
+
+#endif /* INCLUDED_CHANGEDETECTOR_H_1849306 */
@@ -0,0 +1,235 @@
+// Contains a per-thread scheduler that skips or decimates best-effort stages when a frame runs out of time.
+
+#ifndef INCLUDED_DEADLINESCHEDULER_H_7351046
+#define INCLUDED_DEADLINESCHEDULER_H_7351046
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "Metrics.h"
+
+namespace Pipeline
+{
+    enum EStagePriority
+    {
+        // Always runs, e.g. persisting the raw frame. Its cost is reserved from the budget.
+        StagePriority_MustRun,
+        // Runs only if it fits into what is left of the frame budget, e.g. the preview.
+        StagePriority_BestEffort
+    };
+
+    // Tracks the time spent on each frame of one processing thread. Each stage declares a
+    // priority and a deadline relative to the start of the frame; the scheduler keeps a
+    // moving average of every stage's cost. A best-effort stage is skipped if its expected
+    // cost does not fit before its deadline after reserving the must-run stages still
+    // pending, and is decimated (run on every 2nd, 4th, ... frame) while it keeps missing.
+    // All calls except ReportOverrun must come from the thread that processes the frames.
+    class CDeadlineScheduler
+    {
+    public:
+        explicit CDeadlineScheduler( uint64_t frameDeadlineNs, int maxDecimation = 16)
+            : m_frameDeadlineNs( frameDeadlineNs)
+            , m_maxDecimation( maxDecimation)
+            , m_frame( 0)
+            , m_frameStartNs( 0)
+            , m_overrun( false)
+        {
+        }
+
+        // deadlineNs is relative to BeginFrame; 0 means the frame deadline. Register all
+        // stages before the first frame.
+        int AddStage( const std::string& name, EStagePriority priority, uint64_t deadlineNs = 0)
+        {
+            SStage stage;
+            stage.name = name;
+            stage.priority = priority;
+            stage.deadlineNs = deadlineNs;
+            m_stages.push_back( stage);
+            return (int) m_stages.size() - 1;
+        }
+
+        // E.g. the frame period, so that a frame is done before the next one arrives.
+        void SetFrameDeadline( uint64_t frameDeadlineNs)
+        {
+            m_frameDeadlineNs = frameDeadlineNs;
+        }
+
+        uint64_t FrameDeadline() const
+        {
+            return m_frameDeadlineNs;
+        }
+
+        void BeginFrame()
+        {
+            ++m_frame;
+            m_frameStartNs = NowNs();
+            if (m_overrun.exchange( false))
+            {
+                for (size_t i = 0; i < m_stages.size(); ++i)
+                {
+                    Decimate( m_stages[i]);
+                }
+            }
+        }
+
+        // Called from any thread when work was lost anyway, e.g. from OnImagesSkipped.
+        // Halves the rate of all best-effort stages at the next frame.
+        void ReportOverrun()
+        {
+            m_overrun.store( true);
+        }
+
+        bool ShouldRun( int index)
+        {
+            SStage& stage = m_stages[index];
+            if (stage.priority == StagePriority_MustRun)
+            {
+                return true;
+            }
+            if (m_frame % (uint64_t) stage.decimation != 0)
+            {
+                return Shed( stage);
+            }
+
+            const uint64_t deadline = stage.deadlineNs ? stage.deadlineNs : m_frameDeadlineNs;
+            const int64_t remaining = (int64_t) deadline - (int64_t) (NowNs() - m_frameStartNs) - (int64_t) PendingMustRunCost();
+            const int64_t expected = (int64_t) stage.averageCostNs;
+            if (expected > remaining)
+            {
+                Decimate( stage);
+                return Shed( stage);
+            }
+            if (stage.decimation > 1 && 2 * expected <= remaining)
+            {
+                // Comfortably inside the budget again: run more often.
+                stage.decimation /= 2;
+            }
+            return true;
+        }
+
+        // Reports the cost of a stage that ran in the current frame.
+        void EndStage( int index, uint64_t costNs)
+        {
+            SStage& stage = m_stages[index];
+            stage.lastFrame = m_frame;
+            stage.averageCostNs = stage.averageCostNs == 0 ? (double) costNs : stage.averageCostNs + c_smoothing * ((double) costNs - stage.averageCostNs);
+            const uint64_t deadline = stage.deadlineNs ? stage.deadlineNs : m_frameDeadlineNs;
+            if (NowNs() - m_frameStartNs > deadline)
+            {
+                GetMetrics().Add( Counter_DeadlinesMissed);
+            }
+        }
+
+        uint64_t ShedCount( int index) const
+        {
+            return m_stages[index].shed;
+        }
+
+        const std::string& StageName( int index) const
+        {
+            return m_stages[index].name;
+        }
+
+    private:
+        CDeadlineScheduler( const CDeadlineScheduler&);
+        CDeadlineScheduler& operator=( const CDeadlineScheduler&);
+
+        // Weight of the newest sample in the cost average.
+        static constexpr double c_smoothing = 0.125;
+
+        struct SStage
+        {
+            SStage()
+                : priority( StagePriority_BestEffort)
+                , deadlineNs( 0)
+                , averageCostNs( 0)
+                , decimation( 1)
+                , lastFrame( 0)
+                , shed( 0)
+            {
+            }
+
+            std::string name;
+            EStagePriority priority;
+            uint64_t deadlineNs;
+            double averageCostNs;
+            int decimation;
+            uint64_t lastFrame;
+            uint64_t shed;
+        };
+
+        uint64_t PendingMustRunCost() const
+        {
+            double cost = 0;
+            for (size_t i = 0; i < m_stages.size(); ++i)
+            {
+                if (m_stages[i].priority == StagePriority_MustRun && m_stages[i].lastFrame != m_frame)
+                {
+                    cost += m_stages[i].averageCostNs;
+                }
+            }
+            return (uint64_t) cost;
+        }
+
+        void Decimate( SStage& stage)
+        {
+            if (stage.priority == StagePriority_BestEffort && stage.decimation < m_maxDecimation)
+            {
+                stage.decimation *= 2;
+            }
+        }
+
+        bool Shed( SStage& stage)
+        {
+            ++stage.shed;
+            GetMetrics().Add( Counter_StagesShed);
+            return false;
+        }
+
+        std::vector<SStage> m_stages;
+        uint64_t m_frameDeadlineNs;
+        int m_maxDecimation;
+        uint64_t m_frame;
+        uint64_t m_frameStartNs;
+        std::atomic<bool> m_overrun;
+    };
+
+    // Asks the scheduler whether a stage may run and reports its cost when it goes out of
+    // scope. Without a scheduler every stage runs.
+    class CScheduledStage
+    {
+    public:
+        CScheduledStage( CDeadlineScheduler* scheduler, int stage)
+            : m_scheduler( scheduler)
+            , m_stage( stage)
+            , m_run( !scheduler || scheduler->ShouldRun( stage))
+            , m_startNs( NowNs())
+        {
+        }
+
+        ~CScheduledStage()
+        {
+            if (m_scheduler && m_run)
+            {
+                m_scheduler->EndStage( m_stage, NowNs() - m_startNs);
+            }
+        }
+
+        bool Run() const
+        {
+            return m_run;
+        }
+
+    private:
+        CScheduledStage( const CScheduledStage&);
+        CScheduledStage& operator=( const CScheduledStage&);
+
+        CDeadlineScheduler* m_scheduler;
+        int m_stage;
+        bool m_run;
+        uint64_t m_startNs;
+    };
+}
+
+#endif /* INCLUDED_DEADLINESCHEDULER_H_7351046 */
@@ -0,0 +1,274 @@
+// Contains the detection of hot and dead pixels from calibration frames and their sparse in-place correction.
+
+#ifndef INCLUDED_DEFECTPIXELMAP_H_4850627
+#define INCLUDED_DEFECTPIXELMAP_H_4850627
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "opencv2/opencv.hpp"
+#include "FlatFieldCorrection.h"
+
+namespace Pipeline
+{
+    struct SDefectThresholds
+    {
+        SDefectThresholds()
+            : hotAboveLocalMedian( 20.0f)
+            , flatDeviation( 0.25f)
+        {
+        }
+
+        // A pixel is hot if its mean dark level exceeds the local median by this many grey levels.
+        float hotAboveLocalMedian;
+        // A pixel is dead, weak or stuck if its flat response deviates from the local median
+        // by more than this fraction. The local median follows the vignetting.
+        float flatDeviation;
+    };
+
+    // Returns the sorted linear indices (y * width + x) of defective pixels. Either mean frame
+    // (CV_32FC1, see CFlatFieldCalibrator::Average) may be empty.
+    inline std::vector<uint32_t> DetectDefectPixels( const cv::Mat& darkMean, const cv::Mat& flatMean, const SDefectThresholds& thresholds = SDefectThresholds())
+    {
+        std::vector<uint32_t> defects;
+        cv::Mat mean8;
+        cv::Mat localMedian;
+        if (!darkMean.empty())
+        {
+            darkMean.convertTo( mean8, CV_8U);
+            cv::medianBlur( mean8, localMedian, 5);
+            for (int y = 0; y < darkMean.rows; ++y)
+            {
+                const float* dark = darkMean.ptr<float>( y);
+                const uint8_t* median = localMedian.ptr<uint8_t>( y);
+                for (int x = 0; x < darkMean.cols; ++x)
+                {
+                    if (dark[x] - median[x] > thresholds.hotAboveLocalMedian)
+                    {
+                        defects.push_back( (uint32_t) (y * darkMean.cols + x));
+                    }
+                }
+            }
+        }
+        if (!flatMean.empty())
+        {
+            flatMean.convertTo( mean8, CV_8U);
+            cv::medianBlur( mean8, localMedian, 5);
+            for (int y = 0; y < flatMean.rows; ++y)
+            {
+                const float* flat = flatMean.ptr<float>( y);
+                const uint8_t* median = localMedian.ptr<uint8_t>( y);
+                for (int x = 0; x < flatMean.cols; ++x)
+                {
+                    if (std::fabs( flat[x] - median[x]) > thresholds.flatDeviation * std::max( (float) median[x], 1.0f))
+                    {
+                        defects.push_back( (uint32_t) (y * flatMean.cols + x));
+                    }
+                }
+            }
+        }
+        std::sort( defects.begin(), defects.end());
+        defects.erase( std::unique( defects.begin(), defects.end()), defects.end());
+        return defects;
+    }
+
+    // Sparse defect lists for all sequence sets. Correction replaces each listed pixel by the
+    // median of its healthy 8-neighbours, so its cost depends on the number of defects only.
+    // Instances are immutable once built and are shared between threads.
+    class CDefectPixelMap
+    {
+    public:
+        // defects[i] holds the sorted linear indices for sequence set i with frame size sizes[i].
+        CDefectPixelMap( const std::vector<cv::Size>& sizes, const std::vector<std::vector<uint32_t> >& defects)
+            : m_sets( sizes.size())
+        {
+            CV_Assert( sizes.size() == defects.size());
+            for (size_t i = 0; i < sizes.size(); ++i)
+            {
+                BuildSet( sizes[i], defects[i], m_sets[i]);
+            }
+        }
+
+        // Detects the defects of every set from what the calibrator recorded. Returns null if
+        // a set has neither dark nor flat frames, or both of different sizes.
+        static std::shared_ptr<const CDefectPixelMap> Detect( const CFlatFieldCalibrator& calibrator, const SDefectThresholds& thresholds = SDefectThresholds())
+        {
+            std::vector<cv::Size> sizes( calibrator.SetCount());
+            std::vector<std::vector<uint32_t> > defects( calibrator.SetCount());
+            for (size_t i = 0; i < calibrator.SetCount(); ++i)
+            {
+                const cv::Mat dark = calibrator.Average( CalibrationMode_Dark, (int) i);
+                const cv::Mat flat = calibrator.Average( CalibrationMode_Flat, (int) i);
+                if ((dark.empty() && flat.empty()) || (!dark.empty() && !flat.empty() && dark.size() != flat.size()))
+                {
+                    return std::shared_ptr<const CDefectPixelMap>();
+                }
+                sizes[i] = dark.empty() ? flat.size() : dark.size();
+                defects[i] = DetectDefectPixels( dark, flat, thresholds);
+            }
+            return std::make_shared<const CDefectPixelMap>( sizes, defects);
+        }
+
+        bool Covers( int setIndex, cv::Size size) const
+        {
+            return setIndex >= 0 && (size_t) setIndex < m_sets.size() && m_sets[setIndex].size == size;
+        }
+
+        size_t DefectCount( int setIndex) const
+        {
+            return m_sets[setIndex].defects.size();
+        }
+
+        void Correct( int setIndex, cv::Mat& image) const
+        {
+            const SSet& set = m_sets[setIndex];
+            const int stride = (int) image.step;
+            uint8_t* data = image.data;
+            uint8_t neighbours[8];
+            for (size_t i = 0; i < set.defects.size(); ++i)
+            {
+                const SDefect& defect = set.defects[i];
+                const int x = (int) (defect.index % (uint32_t) set.size.width);
+                const int y = (int) (defect.index / (uint32_t) set.size.width);
+                uint8_t* pixel = data + y * stride + x;
+                int count = 0;
+                for (int n = 0; n < 8; ++n)
+                {
+                    if (defect.healthyNeighbours & (1 << n))
+                    {
+                        neighbours[count++] = pixel[NeighbourDy( n) * stride + NeighbourDx( n)];
+                    }
+                }
+                if (count > 0)
+                {
+                    std::nth_element( neighbours, neighbours + count / 2, neighbours + count);
+                    *pixel = neighbours[count / 2];
+                }
+            }
+        }
+
+        bool Save( const std::string& path) const
+        {
+            cv::FileStorage storage( path, cv::FileStorage::WRITE);
+            if (!storage.isOpened())
+            {
+                return false;
+            }
+            storage << "sets" << (int) m_sets.size();
+            for (size_t i = 0; i < m_sets.size(); ++i)
+            {
+                const SSet& set = m_sets[i];
+                cv::Mat indices( (int) set.defects.size(), 1, CV_32SC1);
+                for (size_t d = 0; d < set.defects.size(); ++d)
+                {
+                    indices.at<int32_t>( (int) d, 0) = (int32_t) set.defects[d].index;
+                }
+                storage << Key( "width", i) << set.size.width;
+                storage << Key( "height", i) << set.size.height;
+                storage << Key( "defects", i) << indices;
+            }
+            return true;
+        }
+
+        // Returns null if there is no usable defect map at path.
+        static std::shared_ptr<const CDefectPixelMap> Load( const std::string& path)
+        {
+            cv::FileStorage storage;
+            if (!storage.open( path, cv::FileStorage::READ))
+            {
+                return std::shared_ptr<const CDefectPixelMap>();
+            }
+            const cv::FileNode setsNode = storage["sets"];
+            const int sets = setsNode.empty() ? 0 : (int) setsNode;
+            if (sets <= 0 || sets > c_maxCalibrationSets)
+            {
+                return std::shared_ptr<const CDefectPixelMap>();
+            }
+            std::vector<cv::Size> sizes( sets);
+            std::vector<std::vector<uint32_t> > defects( sets);
+            for (int i = 0; i < sets; ++i)
+            {
+                sizes[i] = cv::Size( (int) storage[Key( "width", i)], (int) storage[Key( "height", i)]);
+                cv::Mat indices;
+                storage[Key( "defects", i)] >> indices;
+                for (int d = 0; d < indices.rows; ++d)
+                {
+                    const int32_t index = indices.at<int32_t>( d, 0);
+                    if (index < 0 || index >= sizes[i].area())
+                    {
+                        return std::shared_ptr<const CDefectPixelMap>();
+                    }
+                    defects[i].push_back( (uint32_t) index);
+                }
+                std::sort( defects[i].begin(), defects[i].end());
+            }
+            return std::make_shared<const CDefectPixelMap>( sizes, defects);
+        }
+
+    private:
+        struct SDefect
+        {
+            uint32_t index;
+            // Bit n is set if neighbour n is inside the image and not itself defective.
+            uint8_t healthyNeighbours;
+        };
+
+        struct SSet
+        {
+            cv::Size size;
+            std::vector<SDefect> defects;
+        };
+
+        static int NeighbourDx( int n)
+        {
+            static const int dx[8] = { -1, 0, 1, -1, 1, -1, 0, 1 };
+            return dx[n];
+        }
+
+        static int NeighbourDy( int n)
+        {
+            static const int dy[8] = { -1, -1, -1, 0, 0, 1, 1, 1 };
+            return dy[n];
+        }
+
+        static std::string Key( const char* name, size_t setIndex)
+        {
+            std::ostringstream key;
+            key << name << "_" << setIndex;
+            return key.str();
+        }
+
+        // Resolves the neighbourhood once, so correction does no searching per frame.
+        static void BuildSet( cv::Size size, const std::vector<uint32_t>& indices, SSet& set)
+        {
+            set.size = size;
+            set.defects.resize( indices.size());
+            for (size_t i = 0; i < indices.size(); ++i)
+            {
+                const int x = (int) (indices[i] % (uint32_t) size.width);
+                const int y = (int) (indices[i] / (uint32_t) size.width);
+                uint8_t healthy = 0;
+                for (int n = 0; n < 8; ++n)
+                {
+                    const int nx = x + NeighbourDx( n);
+                    const int ny = y + NeighbourDy( n);
+                    if (nx >= 0 && ny >= 0 && nx < size.width && ny < size.height
+                        && !std::binary_search( indices.begin(), indices.end(), (uint32_t) (ny * size.width + nx)))
+                    {
+                        healthy = (uint8_t) (healthy | (1 << n));
+                    }
+                }
+                set.defects[i].index = indices[i];
+                set.defects[i].healthyNeighbours = healthy;
+            }
+        }
+
+        std::vector<SSet> m_sets;
+    };
+}
+
+#endif /* INCLUDED_DEFECTPIXELMAP_H_4850627 */
@@ -0,0 +1,322 @@
+// Contains an exposure fusion engine (Mertens et al.) that blends an exposure bracket
+// into a single well-exposed 8-bit image without recovering the camera response.
+
+#ifndef INCLUDED_EXPOSUREFUSION_H_8041736
+#define INCLUDED_EXPOSUREFUSION_H_8041736
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <vector>
+#include "opencv2/opencv.hpp"
+#include "Frame.h"
+
+namespace Pipeline
+{
+    class CExposureFusion
+    {
+    public:
+        // Runs a row kernel over a range of rows, in whatever pieces and on whatever threads
+        // it likes, and returns when all of them are done.
+        typedef std::function<void( const cv::Range&, const std::function<void( const cv::Range&)>&)> CRowRunner;
+
+        // The weights are the exponents of the contrast, saturation and well-exposedness
+        // measures. A maxLevels of 0 builds the full pyramid.
+        CExposureFusion( float contrastWeight = 1.0f, float saturationWeight = 1.0f, float exposednessWeight = 1.0f, int maxLevels = 0)
+            : m_contrastWeight( contrastWeight)
+            , m_saturationWeight( saturationWeight)
+            , m_maxLevels( maxLevels)
+        {
+            // Inputs are 8-bit, so the well-exposedness term is a table lookup.
+            for (int v = 0; v < 256; ++v)
+            {
+                const float d = v / 255.0f - 0.5f;
+                m_exposednessLut[v] = std::pow( std::exp( -d * d / (2.0f * 0.2f * 0.2f)), exposednessWeight);
+            }
+        }
+
+        // Replaces cv::parallel_for_ for the per-row work (weights, per-level blending and
+        // the collapse), e.g. with the tasks of a thread pool the caller already runs.
+        void SetRowRunner( const CRowRunner& runner)
+        {
+            m_rowRunner = runner;
+        }
+
+        // Blends 8UC1 or 8UC3 exposures of equal size into fused, which gets the same type.
+        // All intermediate buffers are kept between calls, so fusing a stream of brackets
+        // of the same geometry does not allocate.
+        void Fuse( const std::vector<cv::Mat>& exposures, cv::Mat& fused)
+        {
+            m_wrapped.resize( exposures.size());
+            for (size_t i = 0; i < exposures.size(); ++i)
+            {
+                m_wrapped[i] = WrapFrame( exposures[i], m_pool);
+            }
+            Fuse( m_wrapped, fused);
+            m_wrapped.clear();
+        }
+
+        // Same as above, but takes the Gaussian levels from the frames' shared pyramids so
+        // that work already done by other stages (or for them) is not repeated.
+        void Fuse( const CBracket& bracket, cv::Mat& fused)
+        {
+            CV_Assert( !bracket.empty());
+            const cv::Size size = bracket[0]->image.size();
+            const int type = bracket[0]->image.type();
+            const int channels = bracket[0]->image.channels();
+            CV_Assert( type == CV_8UC1 || type == CV_8UC3);
+            for (size_t i = 1; i < bracket.size(); ++i)
+            {
+                CV_Assert( bracket[i]->image.size() == size && bracket[i]->image.type() == type);
+            }
+
+            const int levels = std::min( PyramidLevels( size), bracket[0]->pyramid.LevelCount());
+            m_weights.resize( bracket.size());
+            for (size_t i = 0; i < bracket.size(); ++i)
+            {
+                ComputeWeights( bracket[i]->image, m_weights[i]);
+            }
+            NormalizeWeights();
+
+            m_result.resize( levels);
+            m_gaussian.resize( levels);
+            m_weightPyramid.resize( levels);
+            m_expanded.resize( levels);
+            for (size_t i = 0; i < bracket.size(); ++i)
+            {
+                CFramePyramid& pyramid = bracket[i]->pyramid;
+                m_weightPyramid[0] = m_weights[i];
+                for (int l = 0; l < levels; ++l)
+                {
+                    pyramid.Level( l).convertTo( m_gaussian[l], CV_MAKETYPE( CV_32F, channels), 1.0 / 255.0);
+                    if (l > 0)
+                    {
+                        cv::pyrDown( m_weightPyramid[l - 1], m_weightPyramid[l], m_gaussian[l].size());
+                    }
+                }
+                for (int l = 0; l < levels; ++l)
+                {
+                    if (i == 0)
+                    {
+                        m_result[l].create( m_gaussian[l].size(), m_gaussian[l].type());
+                    }
+                    if (l + 1 < levels)
+                    {
+                        cv::pyrUp( m_gaussian[l + 1], m_expanded[l], m_gaussian[l].size());
+                    }
+                    BlendLevel( l, l + 1 < levels, i == 0);
+                }
+            }
+
+            // Collapse the blended Laplacian pyramid.
+            for (int l = levels - 1; l > 0; --l)
+            {
+                cv::pyrUp( m_result[l], m_expanded[l - 1], m_result[l - 1].size());
+                AddInPlace( m_result[l - 1], m_expanded[l - 1]);
+            }
+            m_result[0].convertTo( fused, type, 255.0);
+        }
+
+    private:
+        void ForRows( const cv::Range& range, const std::function<void( const cv::Range&)>& body)
+        {
+            if (m_rowRunner)
+            {
+                m_rowRunner( range, body);
+            }
+            else
+            {
+                cv::parallel_for_( range, body);
+            }
+        }
+
+        int PyramidLevels( cv::Size size) const
+        {
+            int levels = 1;
+            for (int extent = std::min( size.width, size.height); extent > 8; extent /= 2)
+            {
+                ++levels;
+            }
+            return m_maxLevels > 0 ? std::min( levels, m_maxLevels) : levels;
+        }
+
+        // Product of contrast, saturation and well-exposedness, computed stripe-parallel.
+        void ComputeWeights( const cv::Mat& image, cv::Mat& weights)
+        {
+            const int channels = image.channels();
+            if (channels == 1)
+            {
+                m_gray = image;
+            }
+            else
+            {
+                cv::cvtColor( image, m_gray, cv::COLOR_BGR2GRAY);
+            }
+            cv::Laplacian( m_gray, m_laplacian, CV_16S);
+            weights.create( image.size(), CV_32F);
+
+            const float contrastWeight = m_contrastWeight;
+            const float saturationWeight = m_saturationWeight;
+            const float* lut = m_exposednessLut;
+            const cv::Mat& laplacian = m_laplacian;
+            ForRows( cv::Range( 0, image.rows), [&]( const cv::Range& range)
+            {
+                for (int y = range.start; y < range.end; ++y)
+                {
+                    const uint8_t* pixel = image.ptr<uint8_t>( y);
+                    const int16_t* lap = laplacian.ptr<int16_t>( y);
+                    float* weight = weights.ptr<float>( y);
+                    for (int x = 0; x < image.cols; ++x)
+                    {
+                        float contrast = std::abs( (float) lap[x]) * (1.0f / 255.0f);
+                        if (contrastWeight != 1.0f)
+                        {
+                            contrast = std::pow( contrast, contrastWeight);
+                        }
+                        float w = contrast;
+                        if (channels == 3)
+                        {
+                            const float b = pixel[3 * x] * (1.0f / 255.0f);
+                            const float g = pixel[3 * x + 1] * (1.0f / 255.0f);
+                            const float r = pixel[3 * x + 2] * (1.0f / 255.0f);
+                            const float mean = (b + g + r) * (1.0f / 3.0f);
+                            float saturation = std::sqrt( ((b - mean) * (b - mean) + (g - mean) * (g - mean) + (r - mean) * (r - mean)) * (1.0f / 3.0f));
+                            if (saturationWeight != 1.0f)
+                            {
+                                saturation = std::pow( saturation, saturationWeight);
+                            }
+                            w *= saturation * lut[pixel[3 * x]] * lut[pixel[3 * x + 1]] * lut[pixel[3 * x + 2]];
+                        }
+                        else
+                        {
+                            // Saturation is undefined for monochrome input and is left out.
+                            w *= lut[pixel[x]];
+                        }
+                        weight[x] = w + 1e-12f;
+                    }
+                }
+            });
+        }
+
+        void NormalizeWeights()
+        {
+            std::vector<cv::Mat>& weights = m_weights;
+            ForRows( cv::Range( 0, weights[0].rows), [&]( const cv::Range& range)
+            {
+                for (int y = range.start; y < range.end; ++y)
+                {
+                    float* first = weights[0].ptr<float>( y);
+                    for (int x = 0; x < weights[0].cols; ++x)
+                    {
+                        float sum = first[x];
+                        for (size_t i = 1; i < weights.size(); ++i)
+                        {
+                            sum += weights[i].ptr<float>( y)[x];
+                        }
+                        const float scale = 1.0f / sum;
+                        for (size_t i = 0; i < weights.size(); ++i)
+                        {
+                            weights[i].ptr<float>( y)[x] *= scale;
+                        }
+                    }
+                }
+            });
+        }
+
+        // result[l] (+)= (gaussian[l] - expanded[l]) * weightPyramid[l], fused into one pass.
+        void BlendLevel( int level, bool subtractExpanded, bool overwrite)
+        {
+            const cv::Mat& gaussian = m_gaussian[level];
+            const cv::Mat& expanded = m_expanded[level];
+            const cv::Mat& weights = m_weightPyramid[level];
+            cv::Mat& result = m_result[level];
+            const bool color = gaussian.channels() == 3;
+            ForRows( cv::Range( 0, gaussian.rows), [&]( const cv::Range& range)
+            {
+                for (int y = range.start; y < range.end; ++y)
+                {
+                    const float* g = gaussian.ptr<float>( y);
+                    const float* e = subtractExpanded ? expanded.ptr<float>( y) : 0;
+                    const float* w = weights.ptr<float>( y);
+                    float* r = result.ptr<float>( y);
+                    if (color)
+                    {
+                        BlendRow<3>( g, e, w, r, gaussian.cols, overwrite);
+                    }
+                    else
+                    {
+                        BlendRow<1>( g, e, w, r, gaussian.cols, overwrite);
+                    }
+                }
+            });
+        }
+
+        // Kept branch free inside the loops so that the compiler vectorizes them.
+        template <int Channels>
+        static void BlendRow( const float* g, const float* e, const float* w, float* r, int cols, bool overwrite)
+        {
+            if (overwrite)
+            {
+                for (int x = 0; x < cols * Channels; ++x)
+                {
+                    r[x] = 0.0f;
+                }
+            }
+            if (e)
+            {
+                for (int x = 0; x < cols; ++x)
+                {
+                    for (int c = 0; c < Channels; ++c)
+                    {
+                        r[x * Channels + c] += (g[x * Channels + c] - e[x * Channels + c]) * w[x];
+                    }
+                }
+            }
+            else
+            {
+                for (int x = 0; x < cols; ++x)
+                {
+                    for (int c = 0; c < Channels; ++c)
+                    {
+                        r[x * Channels + c] += g[x * Channels + c] * w[x];
+                    }
+                }
+            }
+        }
+
+        void AddInPlace( cv::Mat& accumulator, const cv::Mat& addend)
+        {
+            const int width = accumulator.cols * accumulator.channels();
+            ForRows( cv::Range( 0, accumulator.rows), [&]( const cv::Range& range)
+            {
+                for (int y = range.start; y < range.end; ++y)
+                {
+                    float* a = accumulator.ptr<float>( y);
+                    const float* b = addend.ptr<float>( y);
+                    for (int x = 0; x < width; ++x)
+                    {
+                        a[x] += b[x];
+                    }
+                }
+            });
+        }
+
+        float m_contrastWeight;
+        float m_saturationWeight;
+        int m_maxLevels;
+        float m_exposednessLut[256];
+        CMatPool m_pool;
+        CBracket m_wrapped;
+        CRowRunner m_rowRunner;
+
+        cv::Mat m_gray;
+        cv::Mat m_laplacian;
+        std::vector<cv::Mat> m_weights;
+        std::vector<cv::Mat> m_gaussian;
+        std::vector<cv::Mat> m_weightPyramid;
+        std::vector<cv::Mat> m_expanded;
+        std::vector<cv::Mat> m_result;
+    };
+}
+
+#endif /* INCLUDED_EXPOSUREFUSION_H_8041736 */
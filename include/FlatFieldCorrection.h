@@ -0,0 +1,304 @@
+// Contains dark frame and flat field calibration and the per-pixel fixed-point correction built from it.
+
+#ifndef INCLUDED_FLATFIELDCORRECTION_H_3718265
+#define INCLUDED_FLATFIELDCORRECTION_H_3718265
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "opencv2/opencv.hpp"
+#include "Frame.h"
+
+namespace Pipeline
+{
+    // The camera's sequencer has at most 64 sets; a calibration file that claims more is corrupt.
+    static const int c_maxCalibrationSets = 64;
+
+    // Per-pixel tables for all sequence sets: out = (in - offset) * gain, with the dark
+    // level as an 8-bit offset and the gain in unsigned Q2.14, i.e. 3 bytes per pixel.
+    // Instances are immutable once built and are shared between threads.
+    class CFlatFieldCorrection
+    {
+    public:
+        static const int c_gainFractionBits = 14;
+
+        // offsets[i] is CV_8UC1 and gains[i] CV_16UC1, both of the frame size of set i.
+        CFlatFieldCorrection( const std::vector<cv::Mat>& offsets, const std::vector<cv::Mat>& gains)
+            : m_offsets( offsets)
+            , m_gains( gains)
+        {
+            CV_Assert( offsets.size() == gains.size());
+        }
+
+        bool Covers( int setIndex, cv::Size size) const
+        {
+            return setIndex >= 0 && (size_t) setIndex < m_offsets.size() && m_offsets[setIndex].size() == size;
+        }
+
+        // Copies and corrects in a single pass over the source, which may be the grab buffer.
+        void Correct( int setIndex, const uint8_t* source, size_t sourceStride, cv::Mat& destination) const
+        {
+            const cv::Mat& offset = m_offsets[setIndex];
+            const cv::Mat& gain = m_gains[setIndex];
+            cv::parallel_for_( cv::Range( 0, destination.rows), [&]( const cv::Range& range)
+            {
+                for (int y = range.start; y < range.end; ++y)
+                {
+                    CorrectRow( source + y * sourceStride, offset.ptr<uint8_t>( y), gain.ptr<uint16_t>( y), destination.ptr<uint8_t>( y), destination.cols);
+                }
+            });
+        }
+
+        void Correct( int setIndex, cv::Mat& image) const
+        {
+            Correct( setIndex, image.data, image.step, image);
+        }
+
+        bool Save( const std::string& path) const
+        {
+            cv::FileStorage storage( path, cv::FileStorage::WRITE);
+            if (!storage.isOpened())
+            {
+                return false;
+            }
+            storage << "sets" << (int) m_offsets.size();
+            for (size_t i = 0; i < m_offsets.size(); ++i)
+            {
+                storage << Key( "offset", i) << m_offsets[i];
+                storage << Key( "gain", i) << m_gains[i];
+            }
+            return true;
+        }
+
+        // Returns null if there is no usable calibration at path.
+        static std::shared_ptr<const CFlatFieldCorrection> Load( const std::string& path)
+        {
+            cv::FileStorage storage;
+            if (!storage.open( path, cv::FileStorage::READ))
+            {
+                return std::shared_ptr<const CFlatFieldCorrection>();
+            }
+            const cv::FileNode setsNode = storage["sets"];
+            const int sets = setsNode.empty() ? 0 : (int) setsNode;
+            if (sets <= 0 || sets > c_maxCalibrationSets)
+            {
+                return std::shared_ptr<const CFlatFieldCorrection>();
+            }
+            std::vector<cv::Mat> offsets( sets);
+            std::vector<cv::Mat> gains( sets);
+            for (int i = 0; i < sets; ++i)
+            {
+                storage[Key( "offset", i)] >> offsets[i];
+                storage[Key( "gain", i)] >> gains[i];
+                if (offsets[i].type() != CV_8UC1 || gains[i].type() != CV_16UC1 || offsets[i].size() != gains[i].size())
+                {
+                    return std::shared_ptr<const CFlatFieldCorrection>();
+                }
+            }
+            return std::make_shared<const CFlatFieldCorrection>( offsets, gains);
+        }
+
+    private:
+        static std::string Key( const char* name, size_t setIndex)
+        {
+            std::ostringstream key;
+            key << name << "_" << setIndex;
+            return key.str();
+        }
+
+        // Integer multiply-add without branches; GCC vectorizes it at -O3.
+        static void CorrectRow( const uint8_t* source, const uint8_t* offset, const uint16_t* gain, uint8_t* destination, int cols)
+        {
+            const int rounding = 1 << (c_gainFractionBits - 1);
+            for (int x = 0; x < cols; ++x)
+            {
+                int value = (int) source[x] - (int) offset[x];
+                value = value < 0 ? 0 : value;
+                value = (value * (int) gain[x] + rounding) >> c_gainFractionBits;
+                destination[x] = (uint8_t) (value > 255 ? 255 : value);
+            }
+        }
+
+        std::vector<cv::Mat> m_offsets;
+        std::vector<cv::Mat> m_gains;
+    };
+
+    enum ECalibrationMode
+    {
+        CalibrationMode_Off,
+        // Lens covered: records the fixed-pattern offset.
+        CalibrationMode_Dark,
+        // Uniformly lit target: records vignetting and pixel response.
+        CalibrationMode_Flat
+    };
+
+    // Averages raw frames per sequence set, since every set has its own exposure time,
+    // and turns the averages into a CFlatFieldCorrection. Thread safe.
+    class CFlatFieldCalibrator
+    {
+    public:
+        explicit CFlatFieldCalibrator( size_t setCount)
+            : m_mode( CalibrationMode_Off)
+            , m_framesPerSet( 0)
+            , m_dark( setCount)
+            , m_flat( setCount)
+        {
+        }
+
+        // Starts (or restarts) recording framesPerSet frames of every set.
+        void Start( ECalibrationMode mode, int framesPerSet)
+        {
+            std::lock_guard<std::mutex> lock( m_mutex);
+            m_mode = mode;
+            m_framesPerSet = framesPerSet;
+            std::vector<SAverage>& averages = mode == CalibrationMode_Dark ? m_dark : m_flat;
+            for (size_t i = 0; i < averages.size(); ++i)
+            {
+                averages[i].sum.release();
+                averages[i].count = 0;
+            }
+        }
+
+        bool IsRecording() const
+        {
+            std::lock_guard<std::mutex> lock( m_mutex);
+            return m_mode != CalibrationMode_Off;
+        }
+
+        // Feeds one uncorrected frame. Recording stops by itself once every set has enough frames.
+        void Accumulate( const CFrame& frame)
+        {
+            std::lock_guard<std::mutex> lock( m_mutex);
+            if (m_mode == CalibrationMode_Off || frame.setIndex < 0 || (size_t) frame.setIndex >= m_dark.size())
+            {
+                return;
+            }
+            std::vector<SAverage>& averages = m_mode == CalibrationMode_Dark ? m_dark : m_flat;
+            SAverage& average = averages[frame.setIndex];
+            if (average.count >= m_framesPerSet)
+            {
+                return;
+            }
+            if (average.sum.size() != frame.image.size())
+            {
+                average.sum = cv::Mat::zeros( frame.image.size(), CV_32SC1);
+                average.count = 0;
+            }
+            for (int y = 0; y < frame.image.rows; ++y)
+            {
+                const uint8_t* pixel = frame.image.ptr<uint8_t>( y);
+                int32_t* sum = average.sum.ptr<int32_t>( y);
+                for (int x = 0; x < frame.image.cols; ++x)
+                {
+                    sum[x] += pixel[x];
+                }
+            }
+            ++average.count;
+
+            bool complete = true;
+            for (size_t i = 0; i < averages.size(); ++i)
+            {
+                complete = complete && averages[i].count >= m_framesPerSet;
+            }
+            if (complete)
+            {
+                m_mode = CalibrationMode_Off;
+            }
+        }
+
+        // Mean dark or flat frame of a set as CV_32FC1; empty if nothing was recorded.
+        cv::Mat Average( ECalibrationMode mode, int setIndex) const
+        {
+            std::lock_guard<std::mutex> lock( m_mutex);
+            const SAverage& average = (mode == CalibrationMode_Dark ? m_dark : m_flat)[setIndex];
+            cv::Mat mean;
+            if (average.count > 0)
+            {
+                average.sum.convertTo( mean, CV_32F, 1.0 / average.count);
+            }
+            return mean;
+        }
+
+        size_t SetCount() const
+        {
+            return m_dark.size();
+        }
+
+        // Builds the tables from what has been recorded. A set without dark frames gets a
+        // zero offset, one without flat frames unit gain. Returns null if a set has neither,
+        // or if its dark and flat frames differ in size, i.e. were recorded at different AOIs.
+        std::shared_ptr<const CFlatFieldCorrection> Build() const
+        {
+            std::vector<cv::Mat> offsets( SetCount());
+            std::vector<cv::Mat> gains( SetCount());
+            for (size_t i = 0; i < SetCount(); ++i)
+            {
+                const cv::Mat dark = Average( CalibrationMode_Dark, (int) i);
+                const cv::Mat flat = Average( CalibrationMode_Flat, (int) i);
+                if ((dark.empty() && flat.empty()) || (!dark.empty() && !flat.empty() && dark.size() != flat.size()))
+                {
+                    return std::shared_ptr<const CFlatFieldCorrection>();
+                }
+                const cv::Size size = dark.empty() ? flat.size() : dark.size();
+                offsets[i] = cv::Mat( size, CV_8UC1);
+                gains[i] = cv::Mat( size, CV_16UC1);
+
+                double target = 0;
+                if (!flat.empty())
+                {
+                    for (int y = 0; y < size.height; ++y)
+                    {
+                        for (int x = 0; x < size.width; ++x)
+                        {
+                            target += flat.at<float>( y, x) - (dark.empty() ? 0.0f : dark.at<float>( y, x));
+                        }
+                    }
+                    target /= size.area();
+                }
+
+                const float maxGain = (float) (65535.0 / (1 << CFlatFieldCorrection::c_gainFractionBits));
+                for (int y = 0; y < size.height; ++y)
+                {
+                    for (int x = 0; x < size.width; ++x)
+                    {
+                        const float darkLevel = dark.empty() ? 0.0f : dark.at<float>( y, x);
+                        offsets[i].at<uint8_t>( y, x) = cv::saturate_cast<uint8_t>( darkLevel);
+                        float gain = 1.0f;
+                        if (!flat.empty())
+                        {
+                            const float response = flat.at<float>( y, x) - darkLevel;
+                            // Pixels that do not respond at all are left alone here.
+                            gain = response > 0.5f ? (float) target / response : 1.0f;
+                        }
+                        gains[i].at<uint16_t>( y, x) = (uint16_t) (std::min( gain, maxGain) * (1 << CFlatFieldCorrection::c_gainFractionBits) + 0.5f);
+                    }
+                }
+            }
+            return std::make_shared<const CFlatFieldCorrection>( offsets, gains);
+        }
+
+    private:
+        struct SAverage
+        {
+            SAverage()
+                : count( 0)
+            {
+            }
+
+            cv::Mat sum;
+            int count;
+        };
+
+        mutable std::mutex m_mutex;
+        ECalibrationMode m_mode;
+        int m_framesPerSet;
+        std::vector<SAverage> m_dark;
+        std::vector<SAverage> m_flat;
+    };
+}
+
+#endif /* INCLUDED_FLATFIELDCORRECTION_H_3718265 */
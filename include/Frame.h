@@ -0,0 +1,88 @@
+// Contains the reference counted frame handle passed between pipeline stages.
+
+#ifndef INCLUDED_FRAME_H_6620193
+#define INCLUDED_FRAME_H_6620193
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include "opencv2/opencv.hpp"
+#include "FramePyramid.h"
+#include "MatPool.h"
+
+namespace Pipeline
+{
+    // One grabbed image and the acquisition parameters it was taken with.
+    class CFrame
+    {
+    public:
+        CFrame()
+            : frameNumber( 0)
+            , setIndex( 0)
+            , exposureUs( 0)
+            , timestamp( 0)
+        {
+        }
+
+        cv::Mat image;
+        uint64_t frameNumber;
+        // Index of the sequence set the camera used, i.e. the position within the exposure bracket.
+        int setIndex;
+        double exposureUs;
+        // Camera timestamp in device ticks.
+        uint64_t timestamp;
+        // Downsampled copies of image, built on first use and shared by all stages.
+        // Stages that modify image in place must run before the frame is handed on.
+        CFramePyramid pyramid;
+    };
+
+    typedef std::shared_ptr<CFrame> CFramePtr;
+
+    // Implemented by stages that want to see every frame right after it was grabbed.
+    // OnFrame is called on the grab thread and must not keep it busy.
+    class IFrameConsumer
+    {
+    public:
+        virtual ~IFrameConsumer()
+        {
+        }
+
+        virtual void OnFrame( const CFramePtr& frame) = 0;
+    };
+
+    // Exposure bracket with one frame per sequence set, ordered by set index.
+    typedef std::vector<CFramePtr> CBracket;
+
+    // Creates a frame whose image comes from the pool and goes back to it when the last
+    // reference to the frame is dropped.
+    inline CFramePtr AcquireFrame( const CMatPool& pool, int rows, int cols, int type)
+    {
+        struct SReleaseToPool
+        {
+            CMatPool pool;
+            void operator()( CFrame* frame) const
+            {
+                frame->pyramid.Reset( cv::Mat(), pool);
+                pool.Release( frame->image);
+                delete frame;
+            }
+        };
+        SReleaseToPool releaser = { pool };
+        CFramePtr frame( new CFrame, releaser);
+        frame->image = pool.Acquire( rows, cols, type);
+        frame->pyramid.Reset( frame->image, pool);
+        return frame;
+    }
+
+    // Wraps an image that is not owned by a pool, e.g. one read from disk. Only the
+    // pyramid levels are taken from the pool.
+    inline CFramePtr WrapFrame( const cv::Mat& image, const CMatPool& pool)
+    {
+        CFramePtr frame( new CFrame);
+        frame->image = image;
+        frame->pyramid.Reset( frame->image, pool);
+        return frame;
+    }
+}
+
+#endif /* INCLUDED_FRAME_H_6620193 */
@@ -0,0 +1,95 @@
+// Contains a lazily built Gaussian pyramid that is shared by every stage looking at the same frame.
+
+#ifndef INCLUDED_FRAMEPYRAMID_H_1748350
+#define INCLUDED_FRAMEPYRAMID_H_1748350
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include "opencv2/opencv.hpp"
+#include "MatPool.h"
+
+namespace Pipeline
+{
+    // Level 0 is the frame itself; level n is reduced by 2^n with the 5-tap kernel of cv::pyrDown.
+    // A level is only computed when somebody asks for it, and then only once. Levels are
+    // immutable once built, so readers of built levels never take the lock.
+    class CFramePyramid
+    {
+    public:
+        static const int c_maxLevels = 12;
+
+        CFramePyramid()
+            : m_builtLevels( 0)
+        {
+        }
+
+        ~CFramePyramid()
+        {
+            Clear();
+        }
+
+        // Not thread safe; call before the frame is shared with other stages.
+        void Reset( const cv::Mat& base, const CMatPool& pool)
+        {
+            Clear();
+            m_pool = pool;
+            m_levels[0] = base;
+            m_builtLevels.store( base.empty() ? 0 : 1, std::memory_order_release);
+        }
+
+        // Number of levels that can be requested, limited by the image size.
+        int LevelCount() const
+        {
+            int levels = m_levels[0].empty() ? 0 : 1;
+            for (int extent = std::min( m_levels[0].cols, m_levels[0].rows); extent > 1 && levels < c_maxLevels; extent = (extent + 1) / 2)
+            {
+                ++levels;
+            }
+            return levels;
+        }
+
+        const cv::Mat& Level( int level)
+        {
+            CV_Assert( level >= 0 && level < LevelCount());
+            if (level < m_builtLevels.load( std::memory_order_acquire))
+            {
+                return m_levels[level];
+            }
+
+            std::lock_guard<std::mutex> lock( m_mutex);
+            for (int l = m_builtLevels.load( std::memory_order_relaxed); l <= level; ++l)
+            {
+                const cv::Mat& source = m_levels[l - 1];
+                const cv::Size size( (source.cols + 1) / 2, (source.rows + 1) / 2);
+                m_levels[l] = m_pool.Acquire( size, source.type());
+                cv::pyrDown( source, m_levels[l], size);
+                m_builtLevels.store( l + 1, std::memory_order_release);
+            }
+            return m_levels[level];
+        }
+
+    private:
+        CFramePyramid( const CFramePyramid&);
+        CFramePyramid& operator=( const CFramePyramid&);
+
+        void Clear()
+        {
+            const int built = m_builtLevels.load( std::memory_order_acquire);
+            // Level 0 belongs to the frame.
+            for (int l = 1; l < built; ++l)
+            {
+                m_pool.Release( m_levels[l]);
+            }
+            m_levels[0].release();
+            m_builtLevels.store( 0, std::memory_order_release);
+        }
+
+        CMatPool m_pool;
+        cv::Mat m_levels[c_maxLevels];
+        std::atomic<int> m_builtLevels;
+        std::mutex m_mutex;
+    };
+}
+
+#endif /* INCLUDED_FRAMEPYRAMID_H_1748350 */
@@ -0,0 +1,80 @@
+// Contains conversions between 32-bit floats and IEEE 754 half floats stored as uint16_t.
+
+#ifndef INCLUDED_HALFFLOAT_H_7305518
+#define INCLUDED_HALFFLOAT_H_7305518
+
+#include <cstdint>
+#include <cstring>
+
+namespace Pipeline
+{
+    // Rounds to nearest even; overflows to infinity, keeps NaN and produces denormals.
+    inline uint16_t FloatToHalf( float value)
+    {
+        const uint32_t f32Infinity = 255u << 23;
+        const uint32_t f16Overflow = (127u + 16u) << 23;
+        const uint32_t denormalMagicBits = ((127u - 15u) + (23u - 10u) + 1u) << 23;
+
+        uint32_t bits;
+        std::memcpy( &bits, &value, sizeof( bits));
+        const uint32_t sign = bits & 0x80000000u;
+        bits ^= sign;
+
+        uint16_t half;
+        if (bits >= f16Overflow)
+        {
+            half = bits > f32Infinity ? 0x7e00 : 0x7c00;
+        }
+        else if (bits < (113u << 23))
+        {
+            // Let the FPU do the denormal rounding by adding a magic number.
+            float denormalMagic;
+            std::memcpy( &denormalMagic, &denormalMagicBits, sizeof( denormalMagic));
+            float magnitude;
+            std::memcpy( &magnitude, &bits, sizeof( magnitude));
+            magnitude += denormalMagic;
+            std::memcpy( &bits, &magnitude, sizeof( bits));
+            half = (uint16_t) (bits - denormalMagicBits);
+        }
+        else
+        {
+            const uint32_t mantissaOdd = (bits >> 13) & 1u;
+            bits += ((uint32_t) (15 - 127) << 23) + 0xfffu;
+            bits += mantissaOdd;
+            half = (uint16_t) (bits >> 13);
+        }
+        return (uint16_t) (half | (sign >> 16));
+    }
+
+    inline float HalfToFloat( uint16_t half)
+    {
+        const uint32_t shiftedExponent = 0x7c00u << 13;
+        const uint32_t magicBits = 113u << 23;
+
+        uint32_t bits = ((uint32_t) half & 0x7fffu) << 13;
+        const uint32_t exponent = shiftedExponent & bits;
+        bits += (127u - 15u) << 23;
+        if (exponent == shiftedExponent)
+        {
+            // Infinity or NaN.
+            bits += (128u - 16u) << 23;
+        }
+        else if (exponent == 0)
+        {
+            // Zero or denormal.
+            bits += 1u << 23;
+            float value;
+            float magic;
+            std::memcpy( &value, &bits, sizeof( value));
+            std::memcpy( &magic, &magicBits, sizeof( magic));
+            value -= magic;
+            std::memcpy( &bits, &value, sizeof( bits));
+        }
+        bits |= ((uint32_t) half & 0x8000u) << 16;
+        float value;
+        std::memcpy( &value, &bits, sizeof( value));
+        return value;
+    }
+}
+
+#endif /* INCLUDED_HALFFLOAT_H_7305518 */
@@ -0,0 +1,235 @@
+// Contains the merge of a gamma encoded exposure bracket into a half-float radiance map.
+
+#ifndef INCLUDED_HDRMERGE_H_5520964
+#define INCLUDED_HDRMERGE_H_5520964
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+#include "opencv2/opencv.hpp"
+#include "Frame.h"
+#include "HalfFloat.h"
+#include "Metrics.h"
+
+namespace Pipeline
+{
+    // Pixel values at or below this carry no usable signal.
+    static const int c_hdrDarkLimit = 4;
+    // Pixel values at or above this are treated as clipped.
+    static const int c_hdrSaturationLimit = 251;
+
+    class CHdrMerge
+    {
+    public:
+        // Edge length of the tiles whose useless exposures are skipped.
+        static const int c_tileSize = 64;
+
+        // cameraGamma is the value the camera's Gamma feature is set to (0.46 in main.cpp);
+        // the merge undoes it before averaging.
+        explicit CHdrMerge( double cameraGamma = 0.46)
+            : m_longestScale( 1.0f)
+        {
+            for (int z = 0; z < 256; ++z)
+            {
+                m_linear[z] = (float) std::pow( z / 255.0, 1.0 / cameraGamma);
+                // Hat weight that is exactly zero outside the usable range.
+                m_weight[z] = (z <= c_hdrDarkLimit || z >= c_hdrSaturationLimit) ? 0.0f : (float) std::min( z, 255 - z) / 127.5f;
+            }
+        }
+
+        // Undoes the camera gamma, e.g. to compare against reference linear images.
+        float Linearize( uint8_t value) const
+        {
+            return m_linear[value];
+        }
+
+        // Merges a Mono8 bracket into radiance (CV_16UC1 holding half floats). Radiance is
+        // expressed relative to the shortest exposure, i.e. 1.0 is a pixel that would just
+        // clip in it, which keeps typical scenes well inside the half-float range.
+        //
+        // The image is processed in tiles. A min/max pass over each tile first finds the
+        // exposures that are entirely dark or entirely clipped there; their weight is zero
+        // for every pixel, so the merge leaves them out of that tile without changing the
+        // result. The tile is still in cache from that pass when it is merged.
+        void Merge( const CBracket& bracket, cv::Mat& radiance)
+        {
+            Prepare( bracket, radiance);
+            cv::parallel_for_( cv::Range( 0, BandCount( bracket)), [&]( const cv::Range& bands)
+            {
+                MergeBands( bracket, radiance, bands);
+            });
+        }
+
+        // The band-wise form of Merge for callers with their own thread pool: Prepare once,
+        // then MergeBands over disjoint subranges of [0, BandCount) from any threads.
+        void Prepare( const CBracket& bracket, cv::Mat& radiance)
+        {
+            CV_Assert( !bracket.empty() && bracket.size() <= 32);
+            const size_t count = bracket.size();
+            const cv::Size size = bracket[0]->image.size();
+            for (size_t i = 0; i < count; ++i)
+            {
+                CV_Assert( bracket[i]->image.type() == CV_8UC1 && bracket[i]->image.size() == size);
+            }
+
+            // Order exposures from short to long for the clipped/dark fallback below.
+            m_order.resize( count);
+            for (size_t i = 0; i < count; ++i)
+            {
+                m_order[i] = i;
+            }
+            std::sort( m_order.begin(), m_order.end(), SShorterExposure( bracket));
+            const double shortest = bracket[m_order.front()]->exposureUs;
+
+            // The weighted sum per exposure only depends on the 8-bit value.
+            m_numerator.resize( count * 256);
+            for (size_t i = 0; i < count; ++i)
+            {
+                const float relativeExposure = (float) (bracket[m_order[i]]->exposureUs / shortest);
+                for (int z = 0; z < 256; ++z)
+                {
+                    m_numerator[i * 256 + z] = m_weight[z] * m_linear[z] / relativeExposure;
+                }
+            }
+            m_longestScale = (float) (shortest / bracket[m_order.back()]->exposureUs);
+
+            radiance.create( size, CV_16UC1);
+        }
+
+        // Number of bands of c_tileSize rows.
+        static int BandCount( const CBracket& bracket)
+        {
+            return (bracket[0]->image.rows + c_tileSize - 1) / c_tileSize;
+        }
+
+        void MergeBands( const CBracket& bracket, cv::Mat& radiance, const cv::Range& bands) const
+        {
+            const size_t count = bracket.size();
+            const cv::Size size = bracket[0]->image.size();
+            const int tilesX = (size.width + c_tileSize - 1) / c_tileSize;
+            std::vector<const uint8_t*> source( count);
+            std::vector<uint32_t> useful( tilesX);
+            size_t active[32];
+            uint64_t skipped = 0;
+            for (int band = bands.start; band < bands.end; ++band)
+            {
+                const int top = band * c_tileSize;
+                const int bottom = std::min( top + c_tileSize, size.height);
+                FindUsefulExposures( bracket, m_order, top, bottom, &useful[0], tilesX);
+
+                for (int tile = 0; tile < tilesX; ++tile)
+                {
+                    size_t activeCount = 0;
+                    for (size_t i = 0; i < count; ++i)
+                    {
+                        if (useful[tile] & (1u << i))
+                        {
+                            active[activeCount++] = i;
+                        }
+                    }
+                    skipped += count - activeCount;
+
+                    const int left = tile * c_tileSize;
+                    const int right = std::min( left + c_tileSize, size.width);
+                    for (int y = top; y < bottom; ++y)
+                    {
+                        for (size_t i = 0; i < count; ++i)
+                        {
+                            source[i] = bracket[m_order[i]]->image.ptr<uint8_t>( y);
+                        }
+                        MergeRow( &source[0], count, active, activeCount, radiance.ptr<uint16_t>( y), left, right, m_longestScale);
+                    }
+                }
+            }
+            GetMetrics().Add( Counter_MergeTilesSkipped, skipped);
+        }
+
+    private:
+        struct SShorterExposure
+        {
+            explicit SShorterExposure( const CBracket& bracket)
+                : m_bracket( bracket)
+            {
+            }
+
+            bool operator()( size_t a, size_t b) const
+            {
+                return m_bracket[a]->exposureUs < m_bracket[b]->exposureUs;
+            }
+
+            const CBracket& m_bracket;
+        };
+
+        // Sets bit i of useful[tile] if exposure i (shortest first) has a pixel strictly between
+        // the dark and saturation limits in that tile of rows [top, bottom).
+        void FindUsefulExposures( const CBracket& bracket, const std::vector<size_t>& order, int top, int bottom, uint32_t* useful, int tilesX) const
+        {
+            const int width = bracket[0]->image.cols;
+            std::fill( useful, useful + tilesX, 0u);
+            for (size_t i = 0; i < order.size(); ++i)
+            {
+                const cv::Mat& image = bracket[order[i]]->image;
+                for (int tile = 0; tile < tilesX; ++tile)
+                {
+                    const int left = tile * c_tileSize;
+                    const int right = std::min( left + c_tileSize, width);
+                    uint8_t low = 255;
+                    uint8_t high = 0;
+                    for (int y = top; y < bottom; ++y)
+                    {
+                        const uint8_t* row = image.ptr<uint8_t>( y);
+                        // Plain min/max reductions, which GCC vectorizes at -O3.
+                        for (int x = left; x < right; ++x)
+                        {
+                            low = row[x] < low ? row[x] : low;
+                            high = row[x] > high ? row[x] : high;
+                        }
+                    }
+                    if (high > c_hdrDarkLimit && low < c_hdrSaturationLimit)
+                    {
+                        useful[tile] |= 1u << i;
+                    }
+                }
+            }
+        }
+
+        // source holds one row pointer per exposure, shortest exposure first; only the
+        // exposures listed in active are accumulated. Skipped ones have zero weight anyway.
+        void MergeRow( const uint8_t* const* source, size_t count, const size_t* active, size_t activeCount, uint16_t* destination, int begin, int end, float longestScale) const
+        {
+            const float* numerator = &m_numerator[0];
+            for (int x = begin; x < end; ++x)
+            {
+                float sum = 0.0f;
+                float weight = 0.0f;
+                for (size_t a = 0; a < activeCount; ++a)
+                {
+                    const size_t i = active[a];
+                    const uint8_t z = source[i][x];
+                    sum += numerator[i * 256 + z];
+                    weight += m_weight[z];
+                }
+                float value;
+                if (weight > 0.0f)
+                {
+                    value = sum / weight;
+                }
+                else
+                {
+                    // No exposure is usable: clipped even in the shortest or dark even in the longest.
+                    value = source[0][x] >= c_hdrSaturationLimit ? m_linear[source[0][x]] : m_linear[source[count - 1][x]] * longestScale;
+                }
+                destination[x] = FloatToHalf( value);
+            }
+        }
+
+        float m_linear[256];
+        float m_weight[256];
+        std::vector<float> m_numerator;
+        std::vector<size_t> m_order;
+        float m_longestScale;
+    };
+}
+
+#endif /* INCLUDED_HDRMERGE_H_5520964 */
@@ -0,0 +1,146 @@
+// Contains a background writer that stores half-float radiance maps as OpenEXR or Radiance .hdr files.
+
+#ifndef INCLUDED_HDRWRITER_H_8163502
+#define INCLUDED_HDRWRITER_H_8163502
+
+#include <cmath>
+#include <cstdio>
+#include <exception>
+#include <string>
+#include <vector>
+#include "opencv2/opencv.hpp"
+#include "Frame.h"
+#include "HalfFloat.h"
+#include "Metrics.h"
+#include "ThreadPool.h"
+#ifdef WITH_OPENEXR
+#    include <ImfChannelList.h>
+#    include <ImfFrameBuffer.h>
+#    include <ImfHeader.h>
+#    include <ImfOutputFile.h>
+#    include <ImfThreading.h>
+#endif
+
+namespace Pipeline
+{
+    enum EHdrFormat
+    {
+        HdrFormat_OpenExr,
+        HdrFormat_Radiance
+    };
+
+#ifdef WITH_OPENEXR
+    static const EHdrFormat c_defaultHdrFormat = HdrFormat_OpenExr;
+#else
+    static const EHdrFormat c_defaultHdrFormat = HdrFormat_Radiance;
+#endif
+
+    // Writes a single channel half-float image as OpenEXR luminance. The pixels are handed
+    // to the library in place. Up to compressionThreads line blocks are compressed at once
+    // on OpenEXR's global thread pool, which is empty unless Imf::setGlobalThreadCount was
+    // called (CHdrWriter does); without it compression runs on the calling thread.
+    inline bool WriteOpenExr( const std::string& path, const cv::Mat& half, int compressionThreads)
+    {
+#ifdef WITH_OPENEXR
+        try
+        {
+            Imf::Header header( half.cols, half.rows);
+            header.compression() = Imf::ZIP_COMPRESSION;
+            header.channels().insert( "Y", Imf::Channel( Imf::HALF));
+            Imf::OutputFile file( path.c_str(), header, compressionThreads);
+            Imf::FrameBuffer frameBuffer;
+            frameBuffer.insert( "Y", Imf::Slice( Imf::HALF, (char*) half.data, sizeof( uint16_t), half.step));
+            file.setFrameBuffer( frameBuffer);
+            file.writePixels( half.rows);
+            return true;
+        }
+        catch (const std::exception&)
+        {
+            return false;
+        }
+#else
+        (void) path;
+        (void) half;
+        (void) compressionThreads;
+        return false;
+#endif
+    }
+
+    // Writes a single channel half-float image as an uncompressed grey Radiance RGBE file.
+    // Only one scanline is expanded at a time.
+    inline bool WriteRadianceHdr( const std::string& path, const cv::Mat& half)
+    {
+        FILE* file = std::fopen( path.c_str(), "wb");
+        if (!file)
+        {
+            return false;
+        }
+        std::fprintf( file, "#?RADIANCE\nFORMAT=32-bit_rle_rgbe\n\n-Y %d +X %d\n", half.rows, half.cols);
+        std::vector<uint8_t> scanline( (size_t) half.cols * 4);
+        bool ok = true;
+        for (int y = 0; ok && y < half.rows; ++y)
+        {
+            const uint16_t* source = half.ptr<uint16_t>( y);
+            for (int x = 0; x < half.cols; ++x)
+            {
+                const float value = HalfToFloat( source[x]);
+                uint8_t* rgbe = &scanline[(size_t) x * 4];
+                if (!(value > 1e-32f))
+                {
+                    rgbe[0] = rgbe[1] = rgbe[2] = rgbe[3] = 0;
+                }
+                else
+                {
+                    int exponent;
+                    const float mantissa = (float) std::frexp( value, &exponent) * 256.0f;
+                    rgbe[0] = rgbe[1] = rgbe[2] = (uint8_t) std::min( mantissa, 255.0f);
+                    rgbe[3] = (uint8_t) (exponent + 128);
+                }
+            }
+            ok = std::fwrite( &scanline[0], 1, scanline.size(), file) == scanline.size();
+        }
+        return std::fclose( file) == 0 && ok;
+    }
+
+    class CHdrWriter
+    {
+    public:
+        CHdrWriter( EHdrFormat format = c_defaultHdrFormat, size_t threadCount = 2, int compressionThreads = 2)
+            : m_format( format)
+            , m_compressionThreads( compressionThreads)
+            , m_pool( threadCount, threadCount * 2)
+        {
+#ifdef WITH_OPENEXR
+            // The pool is process wide; only ever grow it.
+            if (format == HdrFormat_OpenExr && compressionThreads > Imf::globalThreadCount())
+            {
+                Imf::setGlobalThreadCount( compressionThreads);
+            }
+#endif
+        }
+
+        // Queues radiance (CV_16UC1 half floats) for writing to basePath plus the format's
+        // extension. The frame is only referenced, so its buffer returns to its pool once
+        // the file is written. Blocks while the writer is saturated.
+        void Write( const CFramePtr& radiance, const std::string& basePath)
+        {
+            const EHdrFormat format = m_format;
+            const int compressionThreads = m_compressionThreads;
+            m_pool.Submit( [radiance, basePath, format, compressionThreads]()
+            {
+                CScopedLatency latency( Histogram_StageHdrWrite);
+                const bool written = format == HdrFormat_OpenExr
+                    ? WriteOpenExr( basePath + ".exr", radiance->image, compressionThreads)
+                    : WriteRadianceHdr( basePath + ".hdr", radiance->image);
+                GetMetrics().Add( written ? Counter_RadianceMapsWritten : Counter_RadianceMapsFailed);
+            });
+        }
+
+    private:
+        EHdrFormat m_format;
+        int m_compressionThreads;
+        CThreadPool m_pool;
+    };
+}
+
+#endif /* INCLUDED_HDRWRITER_H_8163502 */
@@ -8,17 +8,68 @@
 #include <iostream>
 #include "opencv2/opencv.hpp"
 #include <sstream>
+#include <iomanip>
+#include <algorithm>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "ChangeDetector.h"
+#include "DeadlineScheduler.h"
+#include "Frame.h"
+#include "Metrics.h"
+#include "RoiTracker.h"
 
 namespace Pylon
 {
     class CInstantCamera;
 
-    class CImageEventPrinter : public CImageEventHandler
+    class CImageEventPrinter : public CImageEventHandler, public Pipeline::IFrameConsumer
     {
     public:
         int frameNumber = 0;
+        // Pyramid level shown in the preview window; 1 is half resolution.
+        int previewLevel = 1;
+
+        // Registers saving as must-run and the preview as best-effort work of the grab thread.
+        // Without a scheduler both run for every frame.
+        void SetScheduler( Pipeline::CDeadlineScheduler* scheduler)
+        {
+            m_scheduler = scheduler;
+            m_persistStage = scheduler->AddStage( "persist", Pipeline::StagePriority_MustRun);
+            m_previewStage = scheduler->AddStage( "preview", Pipeline::StagePriority_BestEffort);
+        }
+
+        // Saves a frame only if it differs from the last saved frame of its sequence set.
+        // Frames that are not saved get a line in frames/unchanged.txt naming the saved
+        // image they match. See Pipeline::CChangeDetector for the thresholds.
+        void EnableChangeDetection( double meanThreshold = 1.0, double blockThreshold = 6.0, int maxUnchangedFrames = 0)
+        {
+            m_changeDetector.reset( new Pipeline::CChangeDetector( meanThreshold, blockThreshold, maxUnchangedFrames));
+        }
+
+        // Saves only the padded bounding box of the moving part of each frame and appends its
+        // position to frames/roi.txt. Frames without a tracked region are saved whole.
+        // Off unless enabled, since the saved images then vary in size. See
+        // Pipeline::CRoiTracker for the parameters.
+        void EnableRoiTracking( int level = 3, int motionThreshold = 15, int padding = 32, int holdFrames = 10)
+        {
+            m_roiTracker.reset( new Pipeline::CRoiTracker( level, motionThreshold, padding, holdFrames));
+        }
+
+        // Union of the regions tracked since the last call in frame coordinates, or an empty
+        // rectangle. Called from the main thread to move the camera AOI.
+        cv::Rect TakeTrackedRegion()
+        {
+            std::lock_guard<std::mutex> lock( m_regionMutex);
+            const cv::Rect region = m_trackedRegion;
+            m_trackedRegion = cv::Rect();
+            return region;
+        }
+
         virtual void OnImagesSkipped( CInstantCamera& camera, size_t countOfSkippedImages)
         {
+            Pipeline::GetMetrics().Add( Pipeline::Counter_FramesSkipped, countOfSkippedImages);
             std::cout << "OnImagesSkipped event for device " << camera.GetDeviceInfo().GetModelName() << std::endl;
             std::cout << countOfSkippedImages  << " images have been skipped." << std::endl;
             std::cout << std::endl;
@@ -32,34 +83,123 @@ namespace Pylon
             // Image grabbed successfully?
             if (ptrGrabResult->GrabSucceeded())
             {
+                Pipeline::GetMetrics().Add( Pipeline::Counter_FramesGrabbed);
                 std::cout << "SizeX: " << ptrGrabResult->GetWidth() << std::endl;
                 std::cout << "SizeY: " << ptrGrabResult->GetHeight() << std::endl;
                 const uint8_t *pImageBuffer = (uint8_t *) ptrGrabResult->GetBuffer();
                 std::cout << "Gray value of first pixel: " << (uint32_t) pImageBuffer[0] << std::endl;
                 std::cout << std::endl;
+            }
+            else
+            {
+                Pipeline::GetMetrics().Add( Pipeline::Counter_FramesFailed);
+                std::cout << "Error: " << ptrGrabResult->GetErrorCode() << " " << ptrGrabResult->GetErrorDescription() << std::endl;
+            }
+        }
 
-                CPylonImage pylonImage;//me
-                CImageFormatConverter formatConverter;//me
-                formatConverter.OutputPixelFormat = PixelType_BGR8packed;//me
-                
-                formatConverter.Convert(pylonImage, ptrGrabResult);//me
-                // Create an OpenCV image out of pylon image
-                cv::Mat openCvImage;//me
-                openCvImage = cv::Mat(ptrGrabResult->GetHeight(), ptrGrabResult->GetWidth(), CV_8UC3, (uint8_t *)pylonImage.GetBuffer());//me
+        // Called with the pooled Mono8 copy of every successfully grabbed frame.
+        virtual void OnFrame( const Pipeline::CFramePtr& frame)
+        {
+            std::stringstream mySS;
+            mySS << "frames/image_" << std::setfill('0') << std::setw(5) << std::to_string(frameNumber) <<".jpg";
 
-                std::stringstream mySS;
-                mySS << "frames/image_" << std::setfill('0') << std::setw(5) << std::to_string(frameNumber) <<".jpg";
+            {
+                Pipeline::CScheduledStage persist( m_scheduler, m_persistStage);
+                cv::Rect region;
+                if (m_roiTracker)
+                {
+                    region = m_roiTracker->Track( *frame);
+                    std::lock_guard<std::mutex> lock( m_regionMutex);
+                    m_trackedRegion = m_trackedRegion.area() > 0 ? m_trackedRegion | region : region;
+                }
+                if (m_changeDetector && !m_changeDetector->Changed( *frame))
+                {
+                    RecordUnchanged( *frame);
+                }
+                else
+                {
+                    Pipeline::CScopedLatency latency( Pipeline::Histogram_StageEncode);
+                    // Only an image that is on disk may be named by unchanged.txt later.
+                    if (cv::imwrite(mySS.str(), region.area() > 0 ? frame->image( region) : frame->image))
+                    {
+                        Pipeline::GetMetrics().Add( Pipeline::Counter_FramesPersisted);
+                        RecordSaved( *frame);
+                        if (region.area() > 0)
+                        {
+                            RecordRegion( *frame, region);
+                        }
+                        if (m_changeDetector)
+                        {
+                            m_changeDetector->Persisted( *frame);
+                        }
+                        if (frame->setIndex >= 0)
+                        {
+                            m_lastPersisted.resize( std::max( m_lastPersisted.size(), (size_t) frame->setIndex + 1), -1);
+                            m_lastPersisted[frame->setIndex] = frameNumber;
+                        }
+                    }
+                }
+            }
+            {
+                Pipeline::CScheduledStage preview( m_scheduler, m_previewStage);
+                if (preview.Run())
+                {
+                    Pipeline::CScopedLatency latency( Pipeline::Histogram_StageDisplay);
+                    cv::imshow("left camera", frame->pyramid.Level( std::min( previewLevel, frame->pyramid.LevelCount() - 1)));
+                }
+            }
+            frameNumber++;
+        }
 
-                cv::imwrite(mySS.str(), openCvImage);
-                cv::imshow("left camera", openCvImage);
-                frameNumber++;
+    private:
+        // frames/sets.txt names the sequence set of every saved image, so that batch mode does
+        // not have to derive it from the frame number, which skipped frames shift.
+        void RecordSaved( const Pipeline::CFrame& frame)
+        {
+            if (!m_savedLog.is_open())
+            {
+                m_savedLog.open( "frames/sets.txt", std::ios::app);
+            }
+            m_savedLog << "image_" << std::setfill('0') << std::setw(5) << frameNumber
+                << " set " << frame.setIndex << " timestamp " << frame.timestamp << "\n";
+        }
 
+        void RecordUnchanged( const Pipeline::CFrame& frame)
+        {
+            if (!m_unchangedLog.is_open())
+            {
+                m_unchangedLog.open( "frames/unchanged.txt", std::ios::app);
             }
-            else
+            m_unchangedLog << "image_" << std::setfill('0') << std::setw(5) << frameNumber
+                << " set " << frame.setIndex << " timestamp " << frame.timestamp
+                << " unchanged from image_" << std::setw(5) << m_lastPersisted[frame.setIndex] << "\n";
+            Pipeline::GetMetrics().Add( Pipeline::Counter_FramesUnchanged);
+        }
+
+        void RecordRegion( const Pipeline::CFrame& frame, const cv::Rect& region)
+        {
+            if (!m_regionLog.is_open())
             {
-                std::cout << "Error: " << ptrGrabResult->GetErrorCode() << " " << ptrGrabResult->GetErrorDescription() << std::endl;
+                m_regionLog.open( "frames/roi.txt", std::ios::app);
             }
+            m_regionLog << "image_" << std::setfill('0') << std::setw(5) << frameNumber
+                << " set " << frame.setIndex << " x " << region.x << " y " << region.y
+                << " width " << region.width << " height " << region.height
+                << " of " << frame.image.cols << "x" << frame.image.rows << "\n";
         }
+
+        Pipeline::CDeadlineScheduler* m_scheduler = nullptr;
+        int m_persistStage = 0;
+        int m_previewStage = 0;
+        std::unique_ptr<Pipeline::CChangeDetector> m_changeDetector;
+        // Number of the last saved image of each sequence set.
+        std::vector<int> m_lastPersisted;
+        std::ofstream m_savedLog;
+        std::ofstream m_unchangedLog;
+        std::unique_ptr<Pipeline::CRoiTracker> m_roiTracker;
+        std::ofstream m_regionLog;
+        std::mutex m_regionMutex;
+        cv::Rect m_trackedRegion;
     };
 }
 
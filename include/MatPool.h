@@ -0,0 +1,74 @@
+// Contains a pool that recycles cv::Mat buffers between frames.
+
+#ifndef INCLUDED_MATPOOL_H_4402816
+#define INCLUDED_MATPOOL_H_4402816
+
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "opencv2/opencv.hpp"
+
+namespace Pipeline
+{
+    // Keeps released cv::Mat buffers around so that steady state processing never
+    // allocates. Copies of a pool share the same cache.
+    class CMatPool
+    {
+    public:
+        explicit CMatPool( size_t maxCached = 32)
+            : m_state( std::make_shared<SState>())
+        {
+            m_state->maxCached = maxCached;
+        }
+
+        // Returns a buffer of the requested geometry. The content is undefined.
+        cv::Mat Acquire( int rows, int cols, int type) const
+        {
+            {
+                std::lock_guard<std::mutex> lock( m_state->mutex);
+                std::vector<cv::Mat>& cached = m_state->cached;
+                for (size_t i = cached.size(); i-- > 0; )
+                {
+                    if (cached[i].rows == rows && cached[i].cols == cols && cached[i].type() == type)
+                    {
+                        cv::Mat mat = cached[i];
+                        cached[i] = cached.back();
+                        cached.pop_back();
+                        return mat;
+                    }
+                }
+            }
+            return cv::Mat( rows, cols, type);
+        }
+
+        cv::Mat Acquire( cv::Size size, int type) const
+        {
+            return Acquire( size.height, size.width, type);
+        }
+
+        // Hands the buffer back. Views into a larger buffer are not cached.
+        void Release( cv::Mat& mat) const
+        {
+            if (!mat.empty() && !mat.isSubmatrix())
+            {
+                std::lock_guard<std::mutex> lock( m_state->mutex);
+                if (m_state->cached.size() < m_state->maxCached)
+                {
+                    m_state->cached.push_back( mat);
+                }
+            }
+            mat.release();
+        }
+
+    private:
+        struct SState
+        {
+            size_t maxCached;
+            std::mutex mutex;
+            std::vector<cv::Mat> cached;
+        };
+        std::shared_ptr<SState> m_state;
+    };
+}
+
+#endif /* INCLUDED_MATPOOL_H_4402816 */
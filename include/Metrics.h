@@ -0,0 +1,437 @@
+// Contains lock-free counters, gauges and latency histograms for the grab pipeline
+// and a background writer that periodically dumps a snapshot of them to a file.
+
+#ifndef INCLUDED_METRICS_H_5183027
+#define INCLUDED_METRICS_H_5183027
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace Pipeline
+{
+    // Monotonically increasing event counts.
+    enum ECounter
+    {
+        Counter_FramesGrabbed,
+        Counter_FramesSkipped,
+        Counter_FramesFailed,
+        Counter_FramesPersisted,
+        Counter_FramesUnchanged,
+        Counter_BracketsFused,
+        Counter_BracketsDropped,
+        Counter_RadianceMapsWritten,
+        Counter_RadianceMapsFailed,
+        Counter_FramesShared,
+        Counter_SharedFramesDropped,
+        Counter_StagesShed,
+        Counter_DeadlinesMissed,
+        Counter_MergeTilesSkipped,
+        // Frames whose chunk sequence set differed from the counted one, i.e. frames were lost.
+        Counter_SequenceResyncs,
+        CounterCount
+    };
+
+    // Instantaneous values, e.g. queue depths. Last writer wins.
+    enum EGauge
+    {
+        Gauge_ReadyBuffers,
+        Gauge_QueuedBuffers,
+        Gauge_BracketQueueDepth,
+        GaugeCount
+    };
+
+    // Latency distributions, recorded in nanoseconds.
+    enum EHistogram
+    {
+        Histogram_TriggerWait,
+        Histogram_StageEncode,
+        Histogram_StageDisplay,
+        Histogram_StageIngest,
+        Histogram_StageFusion,
+        Histogram_StageMerge,
+        Histogram_StageHdrWrite,
+        Histogram_StageDenoise,
+        Histogram_StageDefects,
+        Histogram_StageShare,
+        Histogram_StageUndistort,
+        HistogramCount
+    };
+
+    enum EMetricsFormat
+    {
+        MetricsFormat_Prometheus,
+        MetricsFormat_Json
+    };
+
+    // Bucket i counts samples below 2^i microseconds; the last bucket takes everything above.
+    static const size_t c_histogramBucketCount = 32;
+    // Writers are spread over this many cache-line aligned shards so that threads never share a line.
+    static const size_t c_metricsShardCount = 16;
+
+    inline const char* CounterName( ECounter counter)
+    {
+        static const char* const names[CounterCount] =
+        {
+            "frames_grabbed_total",
+            "frames_skipped_total",
+            "frames_failed_total",
+            "frames_persisted_total",
+            "frames_unchanged_total",
+            "brackets_fused_total",
+            "brackets_dropped_total",
+            "radiance_maps_written_total",
+            "radiance_maps_failed_total",
+            "frames_shared_total",
+            "shared_frames_dropped_total",
+            "stages_shed_total",
+            "deadlines_missed_total",
+            "merge_tiles_skipped_total",
+            "sequence_resyncs_total"
+        };
+        return names[counter];
+    }
+
+    inline const char* GaugeName( EGauge gauge)
+    {
+        static const char* const names[GaugeCount] =
+        {
+            "ready_buffers",
+            "queued_buffers",
+            "bracket_queue_depth"
+        };
+        return names[gauge];
+    }
+
+    inline const char* HistogramName( EHistogram histogram)
+    {
+        static const char* const names[HistogramCount] =
+        {
+            "trigger_wait_seconds",
+            "stage_encode_seconds",
+            "stage_display_seconds",
+            "stage_ingest_seconds",
+            "stage_fusion_seconds",
+            "stage_merge_seconds",
+            "stage_hdr_write_seconds",
+            "stage_denoise_seconds",
+            "stage_defects_seconds",
+            "stage_share_seconds",
+            "stage_undistort_seconds"
+        };
+        return names[histogram];
+    }
+
+    inline size_t HistogramBucket( uint64_t nanoseconds)
+    {
+        uint64_t micros = nanoseconds / 1000;
+        if (micros == 0)
+        {
+            return 0;
+        }
+#if defined(__GNUC__)
+        size_t bucket = 64 - __builtin_clzll( micros);
+#else
+        size_t bucket = 0;
+        while (micros != 0)
+        {
+            micros >>= 1;
+            ++bucket;
+        }
+#endif
+        return bucket < c_histogramBucketCount ? bucket : c_histogramBucketCount - 1;
+    }
+
+    inline uint64_t NowNs()
+    {
+        return (uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    struct alignas(64) SMetricsShard
+    {
+        std::atomic<uint64_t> counters[CounterCount];
+        std::atomic<uint64_t> buckets[HistogramCount][c_histogramBucketCount];
+        std::atomic<uint64_t> sumNs[HistogramCount];
+    };
+
+    // Plain copy of all metrics, summed over the shards.
+    struct SMetricsSnapshot
+    {
+        uint64_t counters[CounterCount];
+        int64_t gauges[GaugeCount];
+        uint64_t buckets[HistogramCount][c_histogramBucketCount];
+        uint64_t sumNs[HistogramCount];
+        uint64_t count[HistogramCount];
+    };
+
+    class CMetrics
+    {
+    public:
+        CMetrics()
+        {
+            for (size_t s = 0; s < c_metricsShardCount; ++s)
+            {
+                for (size_t c = 0; c < CounterCount; ++c)
+                {
+                    m_shards[s].counters[c].store( 0, std::memory_order_relaxed);
+                }
+                for (size_t h = 0; h < HistogramCount; ++h)
+                {
+                    for (size_t b = 0; b < c_histogramBucketCount; ++b)
+                    {
+                        m_shards[s].buckets[h][b].store( 0, std::memory_order_relaxed);
+                    }
+                    m_shards[s].sumNs[h].store( 0, std::memory_order_relaxed);
+                }
+            }
+            for (size_t g = 0; g < GaugeCount; ++g)
+            {
+                m_gauges[g].store( 0, std::memory_order_relaxed);
+            }
+        }
+
+        void Add( ECounter counter, uint64_t value = 1)
+        {
+            LocalShard().counters[counter].fetch_add( value, std::memory_order_relaxed);
+        }
+
+        void Set( EGauge gauge, int64_t value)
+        {
+            m_gauges[gauge].store( value, std::memory_order_relaxed);
+        }
+
+        void Record( EHistogram histogram, uint64_t nanoseconds)
+        {
+            SMetricsShard& shard = LocalShard();
+            shard.buckets[histogram][HistogramBucket( nanoseconds)].fetch_add( 1, std::memory_order_relaxed);
+            shard.sumNs[histogram].fetch_add( nanoseconds, std::memory_order_relaxed);
+        }
+
+        void Snapshot( SMetricsSnapshot& snapshot) const
+        {
+            for (size_t c = 0; c < CounterCount; ++c)
+            {
+                snapshot.counters[c] = 0;
+                for (size_t s = 0; s < c_metricsShardCount; ++s)
+                {
+                    snapshot.counters[c] += m_shards[s].counters[c].load( std::memory_order_relaxed);
+                }
+            }
+            for (size_t g = 0; g < GaugeCount; ++g)
+            {
+                snapshot.gauges[g] = m_gauges[g].load( std::memory_order_relaxed);
+            }
+            for (size_t h = 0; h < HistogramCount; ++h)
+            {
+                snapshot.sumNs[h] = 0;
+                snapshot.count[h] = 0;
+                for (size_t b = 0; b < c_histogramBucketCount; ++b)
+                {
+                    snapshot.buckets[h][b] = 0;
+                    for (size_t s = 0; s < c_metricsShardCount; ++s)
+                    {
+                        snapshot.buckets[h][b] += m_shards[s].buckets[h][b].load( std::memory_order_relaxed);
+                    }
+                    snapshot.count[h] += snapshot.buckets[h][b];
+                }
+                for (size_t s = 0; s < c_metricsShardCount; ++s)
+                {
+                    snapshot.sumNs[h] += m_shards[s].sumNs[h].load( std::memory_order_relaxed);
+                }
+            }
+        }
+
+    private:
+        SMetricsShard& LocalShard()
+        {
+            // Each thread picks its shard once; afterwards an update is a single uncontended relaxed add.
+            static std::atomic<unsigned> nextShard( 0);
+            thread_local unsigned shard = nextShard.fetch_add( 1, std::memory_order_relaxed) % c_metricsShardCount;
+            return m_shards[shard];
+        }
+
+        SMetricsShard m_shards[c_metricsShardCount];
+        alignas(64) std::atomic<int64_t> m_gauges[GaugeCount];
+    };
+
+    // Process wide metrics instance shared by all event handlers.
+    inline CMetrics& GetMetrics()
+    {
+        static CMetrics metrics;
+        return metrics;
+    }
+
+    // Records the lifetime of the object into a histogram.
+    class CScopedLatency
+    {
+    public:
+        CScopedLatency( EHistogram histogram, CMetrics& metrics = GetMetrics())
+            : m_metrics( metrics)
+            , m_histogram( histogram)
+            , m_startNs( NowNs())
+        {
+        }
+
+        ~CScopedLatency()
+        {
+            m_metrics.Record( m_histogram, NowNs() - m_startNs);
+        }
+
+    private:
+        CScopedLatency( const CScopedLatency&);
+        CScopedLatency& operator=( const CScopedLatency&);
+
+        CMetrics& m_metrics;
+        EHistogram m_histogram;
+        uint64_t m_startNs;
+    };
+
+    inline void WritePrometheus( std::ostream& out, const SMetricsSnapshot& snapshot)
+    {
+        for (size_t c = 0; c < CounterCount; ++c)
+        {
+            const char* name = CounterName( (ECounter) c);
+            out << "# TYPE camera_" << name << " counter\n";
+            out << "camera_" << name << " " << snapshot.counters[c] << "\n";
+        }
+        for (size_t g = 0; g < GaugeCount; ++g)
+        {
+            const char* name = GaugeName( (EGauge) g);
+            out << "# TYPE camera_" << name << " gauge\n";
+            out << "camera_" << name << " " << snapshot.gauges[g] << "\n";
+        }
+        for (size_t h = 0; h < HistogramCount; ++h)
+        {
+            const char* name = HistogramName( (EHistogram) h);
+            out << "# TYPE camera_" << name << " histogram\n";
+            uint64_t cumulative = 0;
+            for (size_t b = 0; b + 1 < c_histogramBucketCount; ++b)
+            {
+                cumulative += snapshot.buckets[h][b];
+                out << "camera_" << name << "_bucket{le=\"" << (double) (1ull << b) * 1e-6 << "\"} " << cumulative << "\n";
+            }
+            out << "camera_" << name << "_bucket{le=\"+Inf\"} " << snapshot.count[h] << "\n";
+            out << "camera_" << name << "_sum " << (double) snapshot.sumNs[h] * 1e-9 << "\n";
+            out << "camera_" << name << "_count " << snapshot.count[h] << "\n";
+        }
+    }
+
+    inline void WriteJson( std::ostream& out, const SMetricsSnapshot& snapshot)
+    {
+        out << "{\n  \"counters\": {";
+        for (size_t c = 0; c < CounterCount; ++c)
+        {
+            out << (c ? ", " : "") << "\"" << CounterName( (ECounter) c) << "\": " << snapshot.counters[c];
+        }
+        out << "},\n  \"gauges\": {";
+        for (size_t g = 0; g < GaugeCount; ++g)
+        {
+            out << (g ? ", " : "") << "\"" << GaugeName( (EGauge) g) << "\": " << snapshot.gauges[g];
+        }
+        out << "},\n  \"histograms\": {";
+        for (size_t h = 0; h < HistogramCount; ++h)
+        {
+            out << (h ? "," : "") << "\n    \"" << HistogramName( (EHistogram) h) << "\": {\"count\": " << snapshot.count[h]
+                << ", \"sum\": " << (double) snapshot.sumNs[h] * 1e-9 << ", \"buckets_us_pow2\": [";
+            for (size_t b = 0; b < c_histogramBucketCount; ++b)
+            {
+                out << (b ? ", " : "") << snapshot.buckets[h][b];
+            }
+            out << "]}";
+        }
+        out << "\n  }\n}\n";
+    }
+
+    // Background thread that writes a snapshot every period. The file is written next to the
+    // target and renamed over it, so scrapers never see a partially written snapshot.
+    class CMetricsSnapshotWriter
+    {
+    public:
+        CMetricsSnapshotWriter( const std::string& path, EMetricsFormat format, std::chrono::milliseconds period, CMetrics& metrics = GetMetrics())
+            : m_metrics( metrics)
+            , m_path( path)
+            , m_format( format)
+            , m_period( period)
+            , m_stop( false)
+        {
+            m_thread = std::thread( &CMetricsSnapshotWriter::Run, this);
+        }
+
+        ~CMetricsSnapshotWriter()
+        {
+            {
+                std::lock_guard<std::mutex> lock( m_mutex);
+                m_stop = true;
+            }
+            m_wakeUp.notify_one();
+            m_thread.join();
+            // Leave the final values behind.
+            WriteSnapshot();
+        }
+
+        bool WriteSnapshot()
+        {
+            SMetricsSnapshot snapshot;
+            m_metrics.Snapshot( snapshot);
+
+            const std::string temporaryPath = m_path + ".tmp";
+            {
+                std::ofstream out( temporaryPath.c_str(), std::ios::out | std::ios::trunc);
+                if (!out)
+                {
+                    return false;
+                }
+                if (m_format == MetricsFormat_Json)
+                {
+                    WriteJson( out, snapshot);
+                }
+                else
+                {
+                    WritePrometheus( out, snapshot);
+                }
+                if (!out)
+                {
+                    return false;
+                }
+            }
+            return std::rename( temporaryPath.c_str(), m_path.c_str()) == 0;
+        }
+
+    private:
+        CMetricsSnapshotWriter( const CMetricsSnapshotWriter&);
+        CMetricsSnapshotWriter& operator=( const CMetricsSnapshotWriter&);
+
+        void Run()
+        {
+            std::unique_lock<std::mutex> lock( m_mutex);
+            while (!m_stop)
+            {
+                if (m_wakeUp.wait_for( lock, m_period, [this] { return m_stop; }))
+                {
+                    break;
+                }
+                lock.unlock();
+                WriteSnapshot();
+                lock.lock();
+            }
+        }
+
+        CMetrics& m_metrics;
+        std::string m_path;
+        EMetricsFormat m_format;
+        std::chrono::milliseconds m_period;
+        bool m_stop;
+        std::mutex m_mutex;
+        std::condition_variable m_wakeUp;
+        std::thread m_thread;
+    };
+}
+
+#endif /* INCLUDED_METRICS_H_5183027 */
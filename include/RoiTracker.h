@@ -0,0 +1,117 @@
+// Contains a tracker that finds the moving part of each frame on a downsampled pyramid level.
+
+#ifndef INCLUDED_ROITRACKER_H_3308614
+#define INCLUDED_ROITRACKER_H_3308614
+
+#include <algorithm>
+#include <vector>
+#include "opencv2/opencv.hpp"
+#include "Frame.h"
+
+namespace Pipeline
+{
+    // Compares a pyramid level of every frame with the same level of the previous frame of
+    // its sequence set and returns the padded bounding box of the pixels that changed by
+    // more than motionThreshold grey levels, in full resolution coordinates. When nothing
+    // moves the last region of the set is kept for holdFrames frames of the set, so an
+    // object that stops briefly stays covered; after that the region is dropped and the
+    // caller falls back to the full frame, so an object that has left does not pin later
+    // frames to its exit region. Working on level 3 touches 1/64 of the pixels. Called from
+    // one thread.
+    class CRoiTracker
+    {
+    public:
+        // minimumPixels changed pixels on the level are needed to count as motion, which
+        // keeps single noisy pixels from producing a region.
+        CRoiTracker( int level = 3, int motionThreshold = 15, int padding = 32, int holdFrames = 10, int minimumPixels = 4)
+            : m_level( level)
+            , m_motionThreshold( motionThreshold)
+            , m_padding( padding)
+            , m_holdFrames( holdFrames)
+            , m_minimumPixels( minimumPixels)
+        {
+        }
+
+        // Returns an empty rectangle while a set has not seen motion recently. Builds the pyramid level if
+        // no other stage has.
+        cv::Rect Track( CFrame& frame)
+        {
+            if (frame.setIndex < 0)
+            {
+                return cv::Rect();
+            }
+            if ((size_t) frame.setIndex >= m_sets.size())
+            {
+                m_sets.resize( frame.setIndex + 1);
+            }
+            SSet& set = m_sets[frame.setIndex];
+            const int level = std::min( m_level, frame.pyramid.LevelCount() - 1);
+            const cv::Mat& small = frame.pyramid.Level( level);
+
+            if (set.previous.size() != small.size() || set.imageSize != frame.image.size())
+            {
+                // First frame of the set or the AOI changed.
+                small.copyTo( set.previous);
+                set.imageSize = frame.image.size();
+                set.region = cv::Rect();
+                set.stillFrames = 0;
+                return set.region;
+            }
+
+            cv::absdiff( small, set.previous, m_difference);
+            cv::threshold( m_difference, m_difference, m_motionThreshold, 255, cv::THRESH_BINARY);
+            small.copyTo( set.previous);
+            if (cv::countNonZero( m_difference) < m_minimumPixels)
+            {
+                if (++set.stillFrames > m_holdFrames)
+                {
+                    set.region = cv::Rect();
+                }
+                return set.region;
+            }
+            set.stillFrames = 0;
+            cv::findNonZero( m_difference, m_points);
+            const cv::Rect moving = cv::boundingRect( m_points);
+
+            const int scale = 1 << level;
+            cv::Rect region( moving.x * scale - m_padding, moving.y * scale - m_padding,
+                moving.width * scale + 2 * m_padding, moving.height * scale + 2 * m_padding);
+            set.region = region & cv::Rect( 0, 0, frame.image.cols, frame.image.rows);
+            return set.region;
+        }
+
+        void Reset()
+        {
+            m_sets.clear();
+        }
+
+    private:
+        CRoiTracker( const CRoiTracker&);
+        CRoiTracker& operator=( const CRoiTracker&);
+
+        struct SSet
+        {
+            SSet()
+                : stillFrames( 0)
+            {
+            }
+
+            cv::Mat previous;
+            cv::Size imageSize;
+            cv::Rect region;
+            // Frames of the set without motion since the region was last updated.
+            int stillFrames;
+        };
+
+        int m_level;
+        int m_motionThreshold;
+        int m_padding;
+        int m_holdFrames;
+        int m_minimumPixels;
+        std::vector<SSet> m_sets;
+        cv::Mat m_difference;
+        cv::Mat m_points;
+    };
+}
+
+#endif /* INCLUDED_ROITRACKER_H_3308614 */
@@ -0,0 +1,88 @@
+// Contains a frame consumer that publishes frames into a shared memory ring for other local processes.
+
+#ifndef INCLUDED_SHAREDFRAMEPUBLISHER_H_5408817
+#define INCLUDED_SHAREDFRAMEPUBLISHER_H_5408817
+
+#include <string>
+#include <thread>
+#include "BlockingQueue.h"
+#include "Frame.h"
+#include "Metrics.h"
+#include "SharedFrameRing.h"
+
+namespace Pipeline
+{
+    // Copies frames into a CSharedFrameRingWriter on its own thread. The grab thread and the
+    // bracket worker only queue a reference to the frame, so publishing never delays them;
+    // if the publisher falls behind, frames are dropped and counted.
+    class CSharedFramePublisher : public IFrameConsumer
+    {
+    public:
+        // maxImageBytes must hold the largest frame published, e.g. width * height * 2 for radiance maps.
+        CSharedFramePublisher( const std::string& name, uint32_t slotCount, uint64_t maxImageBytes, size_t queueCapacity = 4)
+            : m_ring( name, slotCount, maxImageBytes)
+            , m_requests( queueCapacity)
+        {
+            m_worker = std::thread( &CSharedFramePublisher::Run, this);
+        }
+
+        virtual ~CSharedFramePublisher()
+        {
+            m_requests.Close();
+            m_worker.join();
+        }
+
+        // Publishes grabbed frames.
+        virtual void OnFrame( const CFramePtr& frame)
+        {
+            Publish( frame, SharedFrameKind_Grabbed);
+        }
+
+        // The frame must not be modified afterwards. Never blocks.
+        void Publish( const CFramePtr& frame, ESharedFrameKind kind)
+        {
+            SRequest request = { frame, kind };
+            if (!m_requests.TryPush( request))
+            {
+                GetMetrics().Add( Counter_SharedFramesDropped);
+            }
+        }
+
+    private:
+        CSharedFramePublisher( const CSharedFramePublisher&);
+        CSharedFramePublisher& operator=( const CSharedFramePublisher&);
+
+        struct SRequest
+        {
+            CFramePtr frame;
+            ESharedFrameKind kind;
+        };
+
+        void Run()
+        {
+            SRequest request;
+            while (m_requests.Pop( request))
+            {
+                SSharedFrameInfo info;
+                info.timestamp = request.frame->timestamp;
+                info.exposureUs = request.frame->exposureUs;
+                info.setIndex = request.frame->setIndex;
+                info.kind = request.kind;
+                bool written;
+                {
+                    CScopedLatency latency( Histogram_StageShare);
+                    written = m_ring.Write( request.frame->image, info);
+                }
+                GetMetrics().Add( written ? Counter_FramesShared : Counter_SharedFramesDropped);
+                // Return the frame to its pool right away.
+                request.frame.reset();
+            }
+        }
+
+        CSharedFrameRingWriter m_ring;
+        CBlockingQueue<SRequest> m_requests;
+        std::thread m_worker;
+    };
+}
+
+#endif /* INCLUDED_SHAREDFRAMEPUBLISHER_H_5408817 */
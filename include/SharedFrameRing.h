@@ -0,0 +1,372 @@
+// Contains the POSIX shared memory frame ring used to hand frames to other local processes:
+// the memory layout, the writer used by the capture process and the read-only subscriber.
+// Consumers only need this header, OpenCV core and -lrt.
+
+#ifndef INCLUDED_SHAREDFRAMERING_H_2264931
+#define INCLUDED_SHAREDFRAMERING_H_2264931
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "opencv2/opencv.hpp"
+
+namespace Pipeline
+{
+    static_assert( ATOMIC_LLONG_LOCK_FREE == 2, "The shared frame ring needs lock-free 64-bit atomics.");
+
+    static const uint32_t c_sharedRingMagic = 0x43465231; // "CFR1"
+    static const uint32_t c_sharedRingVersion = 1;
+
+    enum ESharedFrameKind
+    {
+        SharedFrameKind_Grabbed,
+        SharedFrameKind_Fused,
+        SharedFrameKind_Radiance
+    };
+
+    // Segment header, followed by slotCount slots of slotStride bytes each.
+    struct alignas(64) SSharedRingHeader
+    {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t slotCount;
+        uint32_t slotStride;
+        uint64_t maxImageBytes;
+        // Sequence number of the most recently completed slot; 0 before the first frame.
+        std::atomic<uint64_t> publishedSequence;
+    };
+
+    // Slot header, followed by the pixel data. The fields are guarded by a seqlock:
+    // lock is odd while the writer is inside the slot.
+    struct alignas(64) SSharedSlotHeader
+    {
+        std::atomic<uint64_t> lock;
+        uint64_t sequence;
+        uint64_t timestamp;
+        uint64_t publishTimeNs;
+        double exposureUs;
+        int32_t setIndex;
+        int32_t kind;
+        int32_t width;
+        int32_t height;
+        int32_t type;
+        uint32_t step;
+    };
+
+    // Per-frame data published alongside the pixels.
+    struct SSharedFrameInfo
+    {
+        SSharedFrameInfo()
+            : sequence( 0)
+            , timestamp( 0)
+            , publishTimeNs( 0)
+            , exposureUs( 0)
+            , setIndex( -1)
+            , kind( SharedFrameKind_Grabbed)
+        {
+        }
+
+        uint64_t sequence;
+        // Camera timestamp in device ticks.
+        uint64_t timestamp;
+        // steady_clock time of publication in the capture process.
+        uint64_t publishTimeNs;
+        double exposureUs;
+        int setIndex;
+        ESharedFrameKind kind;
+    };
+
+    inline size_t SharedSlotStride( uint64_t maxImageBytes)
+    {
+        const size_t bytes = sizeof( SSharedSlotHeader) + (size_t) maxImageBytes;
+        return (bytes + 63) & ~(size_t) 63;
+    }
+
+    inline uint64_t SharedRingNowNs()
+    {
+        return (uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // Creates the segment and writes frames into it. A single thread may write. The writer never
+    // waits for readers: it overwrites the oldest slot, and readers detect that via the seqlock.
+    class CSharedFrameRingWriter
+    {
+    public:
+        // name is a POSIX shared memory name such as "/camera_frames".
+        CSharedFrameRingWriter( const std::string& name, uint32_t slotCount, uint64_t maxImageBytes)
+            : m_name( name)
+            , m_size( sizeof( SSharedRingHeader) + (size_t) slotCount * SharedSlotStride( maxImageBytes))
+            , m_base( 0)
+            , m_nextSequence( 1)
+        {
+            int fd = shm_open( name.c_str(), O_CREAT | O_RDWR, 0644);
+            if (fd < 0)
+            {
+                throw std::runtime_error( "shm_open failed for " + name);
+            }
+            if (ftruncate( fd, (off_t) m_size) != 0)
+            {
+                close( fd);
+                shm_unlink( name.c_str());
+                throw std::runtime_error( "ftruncate failed for " + name);
+            }
+            void* base = mmap( 0, m_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            close( fd);
+            if (base == MAP_FAILED)
+            {
+                shm_unlink( name.c_str());
+                throw std::runtime_error( "mmap failed for " + name);
+            }
+            m_base = (uint8_t*) base;
+
+            SSharedRingHeader* header = Header();
+            header->magic = 0;
+            header->version = c_sharedRingVersion;
+            header->slotCount = slotCount;
+            header->slotStride = (uint32_t) SharedSlotStride( maxImageBytes);
+            header->maxImageBytes = maxImageBytes;
+            header->publishedSequence.store( 0, std::memory_order_relaxed);
+            for (uint32_t i = 0; i < slotCount; ++i)
+            {
+                Slot( i)->lock.store( 0, std::memory_order_relaxed);
+            }
+            // Readers only attach once the magic is in place.
+            std::atomic_thread_fence( std::memory_order_release);
+            header->magic = c_sharedRingMagic;
+        }
+
+        ~CSharedFrameRingWriter()
+        {
+            munmap( m_base, m_size);
+            shm_unlink( m_name.c_str());
+        }
+
+        // Copies image into the next slot. Returns false if it does not fit.
+        bool Write( const cv::Mat& image, SSharedFrameInfo info)
+        {
+            SSharedRingHeader* header = Header();
+            const size_t rowBytes = (size_t) image.cols * image.elemSize();
+            if (rowBytes * image.rows > header->maxImageBytes)
+            {
+                return false;
+            }
+
+            info.sequence = m_nextSequence++;
+            SSharedSlotHeader* slot = Slot( (uint32_t) (info.sequence % header->slotCount));
+            const uint64_t lock = slot->lock.load( std::memory_order_relaxed);
+            slot->lock.store( lock + 1, std::memory_order_relaxed);
+            std::atomic_thread_fence( std::memory_order_release);
+
+            slot->sequence = info.sequence;
+            slot->timestamp = info.timestamp;
+            slot->publishTimeNs = SharedRingNowNs();
+            slot->exposureUs = info.exposureUs;
+            slot->setIndex = info.setIndex;
+            slot->kind = info.kind;
+            slot->width = image.cols;
+            slot->height = image.rows;
+            slot->type = image.type();
+            slot->step = (uint32_t) rowBytes;
+            uint8_t* pixels = (uint8_t*) (slot + 1);
+            if (image.isContinuous())
+            {
+                std::memcpy( pixels, image.data, rowBytes * image.rows);
+            }
+            else
+            {
+                for (int y = 0; y < image.rows; ++y)
+                {
+                    std::memcpy( pixels + y * rowBytes, image.ptr( y), rowBytes);
+                }
+            }
+
+            slot->lock.store( lock + 2, std::memory_order_release);
+            header->publishedSequence.store( info.sequence, std::memory_order_release);
+            return true;
+        }
+
+    private:
+        CSharedFrameRingWriter( const CSharedFrameRingWriter&);
+        CSharedFrameRingWriter& operator=( const CSharedFrameRingWriter&);
+
+        SSharedRingHeader* Header() const
+        {
+            return (SSharedRingHeader*) m_base;
+        }
+
+        SSharedSlotHeader* Slot( uint32_t index) const
+        {
+            return (SSharedSlotHeader*) (m_base + sizeof( SSharedRingHeader) + (size_t) index * Header()->slotStride);
+        }
+
+        std::string m_name;
+        size_t m_size;
+        uint8_t* m_base;
+        uint64_t m_nextSequence;
+    };
+
+    // A frame in the ring, viewed in place. image points into read-only shared memory and
+    // is only guaranteed to be intact while CSharedFrameSubscriber::IsIntact returns true.
+    struct SSharedFrame
+    {
+        SSharedFrame()
+            : m_slot( 0)
+            , m_lock( 0)
+        {
+        }
+
+        cv::Mat image;
+        SSharedFrameInfo info;
+
+    private:
+        friend class CSharedFrameSubscriber;
+        const SSharedSlotHeader* m_slot;
+        uint64_t m_lock;
+    };
+
+    // Maps the ring of a running capture process read-only. Reading never blocks or slows
+    // down the writer; a reader that falls behind by more than the ring size loses frames.
+    class CSharedFrameSubscriber
+    {
+    public:
+        explicit CSharedFrameSubscriber( const std::string& name)
+            : m_size( 0)
+            , m_base( 0)
+        {
+            int fd = shm_open( name.c_str(), O_RDONLY, 0);
+            if (fd < 0)
+            {
+                throw std::runtime_error( "No frame ring named " + name);
+            }
+            struct stat status;
+            if (fstat( fd, &status) != 0 || (size_t) status.st_size < sizeof( SSharedRingHeader))
+            {
+                close( fd);
+                throw std::runtime_error( "Frame ring " + name + " is not initialized");
+            }
+            m_size = (size_t) status.st_size;
+            void* base = mmap( 0, m_size, PROT_READ, MAP_SHARED, fd, 0);
+            close( fd);
+            if (base == MAP_FAILED)
+            {
+                throw std::runtime_error( "mmap failed for " + name);
+            }
+            m_base = (const uint8_t*) base;
+            const SSharedRingHeader* header = Header();
+            std::atomic_thread_fence( std::memory_order_acquire);
+            if (header->magic != c_sharedRingMagic || header->version != c_sharedRingVersion
+                || sizeof( SSharedRingHeader) + (size_t) header->slotCount * header->slotStride > m_size)
+            {
+                munmap( (void*) m_base, m_size);
+                throw std::runtime_error( "Frame ring " + name + " has an unknown layout");
+            }
+        }
+
+        ~CSharedFrameSubscriber()
+        {
+            munmap( (void*) m_base, m_size);
+        }
+
+        uint64_t LatestSequence() const
+        {
+            return Header()->publishedSequence.load( std::memory_order_acquire);
+        }
+
+        uint32_t SlotCount() const
+        {
+            return Header()->slotCount;
+        }
+
+        // Maps frame sequence without copying. Fails if it was never published, has already
+        // been overwritten or is being written right now.
+        bool View( uint64_t sequence, SSharedFrame& frame) const
+        {
+            if (sequence == 0 || sequence > LatestSequence())
+            {
+                return false;
+            }
+            const SSharedSlotHeader* slot = Slot( (uint32_t) (sequence % Header()->slotCount));
+            const uint64_t lock = slot->lock.load( std::memory_order_acquire);
+            if ((lock & 1) != 0 || slot->sequence != sequence)
+            {
+                return false;
+            }
+            frame.info.sequence = slot->sequence;
+            frame.info.timestamp = slot->timestamp;
+            frame.info.publishTimeNs = slot->publishTimeNs;
+            frame.info.exposureUs = slot->exposureUs;
+            frame.info.setIndex = slot->setIndex;
+            frame.info.kind = (ESharedFrameKind) slot->kind;
+            frame.image = cv::Mat( slot->height, slot->width, slot->type, (void*) (slot + 1), slot->step);
+            frame.m_slot = slot;
+            frame.m_lock = lock;
+            return IsIntact( frame);
+        }
+
+        // Waits up to timeoutMs for a frame newer than lastSequence and maps the newest one.
+        bool WaitNewer( uint64_t lastSequence, SSharedFrame& frame, int timeoutMs) const
+        {
+            const std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds( timeoutMs);
+            do
+            {
+                const uint64_t latest = LatestSequence();
+                if (latest > lastSequence && View( latest, frame))
+                {
+                    return true;
+                }
+                std::this_thread::sleep_for( std::chrono::microseconds( 500));
+            }
+            while (std::chrono::steady_clock::now() < deadline);
+            return false;
+        }
+
+        // True if the writer has not touched the frame's slot since it was mapped. Check it
+        // after using the view; if it fails, the data read in between may be torn.
+        bool IsIntact( const SSharedFrame& frame) const
+        {
+            std::atomic_thread_fence( std::memory_order_acquire);
+            return frame.m_slot && frame.m_slot->lock.load( std::memory_order_relaxed) == frame.m_lock;
+        }
+
+        // Copies a frame out of the ring; the copy stays valid regardless of the writer.
+        bool Copy( uint64_t sequence, cv::Mat& image, SSharedFrameInfo& info) const
+        {
+            SSharedFrame frame;
+            if (!View( sequence, frame))
+            {
+                return false;
+            }
+            frame.image.copyTo( image);
+            info = frame.info;
+            return IsIntact( frame);
+        }
+
+    private:
+        CSharedFrameSubscriber( const CSharedFrameSubscriber&);
+        CSharedFrameSubscriber& operator=( const CSharedFrameSubscriber&);
+
+        const SSharedRingHeader* Header() const
+        {
+            return (const SSharedRingHeader*) m_base;
+        }
+
+        const SSharedSlotHeader* Slot( uint32_t index) const
+        {
+            return (const SSharedSlotHeader*) (m_base + sizeof( SSharedRingHeader) + (size_t) index * Header()->slotStride);
+        }
+
+        size_t m_size;
+        const uint8_t* m_base;
+    };
+}
+
+#endif /* INCLUDED_SHAREDFRAMERING_H_2264931 */
@@ -0,0 +1,97 @@
+// Contains a motion gated temporal denoiser that averages each sequence set over consecutive brackets.
+
+#ifndef INCLUDED_TEMPORALDENOISER_H_6094183
+#define INCLUDED_TEMPORALDENOISER_H_6094183
+
+#include <cstdint>
+#include <vector>
+#include "opencv2/opencv.hpp"
+#include "Frame.h"
+
+namespace Pipeline
+{
+    // Keeps an exponential running average per sequence set in 8.8 fixed point and replaces
+    // each Mono8 frame by it in place. A pixel that differs from its average by more than
+    // the motion threshold restarts from the new value, so moving parts are not smeared.
+    // The only state is one 16-bit image per sequence set, however long the stream.
+    class CTemporalDenoiser
+    {
+    public:
+        // The new frame contributes 1 / 2^strengthShift to the average, i.e. strengthShift 2
+        // averages roughly the last four brackets. motionThreshold is in grey levels.
+        CTemporalDenoiser( size_t setCount, int strengthShift = 2, int motionThreshold = 12)
+            : m_averages( setCount)
+            , m_strengthShift( strengthShift)
+            , m_motionThreshold( motionThreshold)
+        {
+        }
+
+        void Apply( CFrame& frame)
+        {
+            CV_Assert( frame.image.type() == CV_8UC1);
+            CV_Assert( frame.setIndex >= 0 && (size_t) frame.setIndex < m_averages.size());
+            cv::Mat& average = m_averages[frame.setIndex];
+            cv::Mat& image = frame.image;
+
+            if (average.size() != image.size())
+            {
+                // First frame of this set, or the AOI changed: start over.
+                average.create( image.size(), CV_16UC1);
+                cv::parallel_for_( cv::Range( 0, image.rows), [&]( const cv::Range& range)
+                {
+                    for (int y = range.start; y < range.end; ++y)
+                    {
+                        const uint8_t* pixel = image.ptr<uint8_t>( y);
+                        uint16_t* mean = average.ptr<uint16_t>( y);
+                        for (int x = 0; x < image.cols; ++x)
+                        {
+                            mean[x] = (uint16_t) (pixel[x] << 8);
+                        }
+                    }
+                });
+                return;
+            }
+
+            const int shift = m_strengthShift;
+            const int threshold = m_motionThreshold << 8;
+            cv::parallel_for_( cv::Range( 0, image.rows), [&]( const cv::Range& range)
+            {
+                for (int y = range.start; y < range.end; ++y)
+                {
+                    UpdateRow( image.ptr<uint8_t>( y), average.ptr<uint16_t>( y), image.cols, shift, threshold);
+                }
+            });
+        }
+
+        // Forgets the history, e.g. after the scene or the exposure settings changed.
+        void Reset()
+        {
+            for (size_t i = 0; i < m_averages.size(); ++i)
+            {
+                m_averages[i].release();
+            }
+        }
+
+    private:
+        // Written without branches so that the compiler turns it into SIMD selects.
+        static void UpdateRow( uint8_t* pixel, uint16_t* mean, int cols, int shift, int threshold)
+        {
+            for (int x = 0; x < cols; ++x)
+            {
+                const int current = pixel[x] << 8;
+                const int previous = mean[x];
+                const int difference = current - previous;
+                const int magnitude = difference < 0 ? -difference : difference;
+                const int updated = magnitude > threshold ? current : previous + (difference >> shift);
+                mean[x] = (uint16_t) updated;
+                pixel[x] = (uint8_t) ((updated + 128) >> 8);
+            }
+        }
+
+        std::vector<cv::Mat> m_averages;
+        int m_strengthShift;
+        int m_motionThreshold;
+    };
+}
+
+#endif /* INCLUDED_TEMPORALDENOISER_H_6094183 */
@@ -0,0 +1,66 @@
+// Contains a fixed size thread pool fed through a bounded queue.
+
+#ifndef INCLUDED_THREADPOOL_H_9026431
+#define INCLUDED_THREADPOOL_H_9026431
+
+#include <functional>
+#include <thread>
+#include <vector>
+#include "BlockingQueue.h"
+
+namespace Pipeline
+{
+    class CThreadPool
+    {
+    public:
+        CThreadPool( size_t threadCount, size_t queueCapacity)
+            : m_tasks( queueCapacity)
+        {
+            for (size_t i = 0; i < threadCount; ++i)
+            {
+                m_threads.push_back( std::thread( &CThreadPool::Run, this));
+            }
+        }
+
+        // Finishes all queued tasks before returning.
+        ~CThreadPool()
+        {
+            m_tasks.Close();
+            for (size_t i = 0; i < m_threads.size(); ++i)
+            {
+                m_threads[i].join();
+            }
+        }
+
+        // Blocks while the queue is full, which throttles the submitting thread.
+        void Submit( const std::function<void()>& task)
+        {
+            m_tasks.Push( task);
+        }
+
+        size_t Pending() const
+        {
+            return m_tasks.Size();
+        }
+
+    private:
+        CThreadPool( const CThreadPool&);
+        CThreadPool& operator=( const CThreadPool&);
+
+        void Run()
+        {
+            std::function<void()> task;
+            while (m_tasks.Pop( task))
+            {
+                task();
+                // Release what the task captured now rather than at the next Pop.
+                task = nullptr;
+            }
+        }
+
+        CBlockingQueue<std::function<void()> > m_tasks;
+        std::vector<std::thread> m_threads;
+    };
+}
+
+#endif /* INCLUDED_THREADPOOL_H_9026431 */
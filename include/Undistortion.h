@@ -0,0 +1,121 @@
+// Contains a lens undistortion stage that applies precomputed fixed-point remap tables tile by tile.
+
+#ifndef INCLUDED_UNDISTORTION_H_9026475
+#define INCLUDED_UNDISTORTION_H_9026475
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+#include "opencv2/opencv.hpp"
+#include "Frame.h"
+
+namespace Pipeline
+{
+    // Holds the remap tables for one camera and image size: CV_16SC2 integer source
+    // coordinates plus CV_16UC1 interpolation table indices, built once by
+    // cv::initUndistortRectifyMap. cv::remap takes its vectorized fixed-point path on
+    // these instead of interpolating float maps per pixel. Instances are immutable once
+    // built and are shared between threads.
+    class CUndistortion
+    {
+    public:
+        // Output tiles are remapped in parallel; a tile's source footprint stays in cache.
+        static const int c_tileSize = 128;
+
+        // alpha is passed to cv::getOptimalNewCameraMatrix: 0 keeps only valid pixels,
+        // 1 keeps all source pixels.
+        CUndistortion( const cv::Mat& cameraMatrix, const cv::Mat& distortionCoefficients, cv::Size imageSize, double alpha = 0.0)
+            : m_imageSize( imageSize)
+        {
+            const cv::Mat newCameraMatrix = cv::getOptimalNewCameraMatrix( cameraMatrix, distortionCoefficients, imageSize, alpha, imageSize);
+            cv::initUndistortRectifyMap( cameraMatrix, distortionCoefficients, cv::Mat(), newCameraMatrix, imageSize, CV_16SC2, m_xy, m_interpolation);
+        }
+
+        // Reads camera_matrix, distortion_coefficients, image_width and image_height as written
+        // by OpenCV's calibration sample. Returns null if there is no usable file at path.
+        static std::shared_ptr<const CUndistortion> Load( const std::string& path, double alpha = 0.0)
+        {
+            cv::FileStorage storage;
+            if (!storage.open( path, cv::FileStorage::READ))
+            {
+                return std::shared_ptr<const CUndistortion>();
+            }
+            cv::Mat cameraMatrix;
+            cv::Mat distortionCoefficients;
+            storage["camera_matrix"] >> cameraMatrix;
+            storage["distortion_coefficients"] >> distortionCoefficients;
+            const cv::Size imageSize( (int) storage["image_width"], (int) storage["image_height"]);
+            if (cameraMatrix.rows != 3 || cameraMatrix.cols != 3 || distortionCoefficients.empty() || imageSize.area() <= 0)
+            {
+                return std::shared_ptr<const CUndistortion>();
+            }
+            return std::make_shared<const CUndistortion>( cameraMatrix, distortionCoefficients, imageSize, alpha);
+        }
+
+        cv::Size ImageSize() const
+        {
+            return m_imageSize;
+        }
+
+        // Remaps source into destination, which must not share memory with it. If rois is not
+        // empty, only the tiles touching a region of interest are remapped and the rest of
+        // destination is set to zero.
+        void Apply( const cv::Mat& source, cv::Mat& destination, const std::vector<cv::Rect>& rois = std::vector<cv::Rect>()) const
+        {
+            CV_Assert( source.size() == m_imageSize);
+            destination.create( m_imageSize, source.type());
+            const int tilesX = (m_imageSize.width + c_tileSize - 1) / c_tileSize;
+            const int tilesY = (m_imageSize.height + c_tileSize - 1) / c_tileSize;
+            const cv::Rect image( cv::Point( 0, 0), m_imageSize);
+
+            cv::parallel_for_( cv::Range( 0, tilesX * tilesY), [&]( const cv::Range& range)
+            {
+                for (int t = range.start; t < range.end; ++t)
+                {
+                    const cv::Rect tile = cv::Rect( (t % tilesX) * c_tileSize, (t / tilesX) * c_tileSize, c_tileSize, c_tileSize) & image;
+                    cv::Mat target = destination( tile);
+                    if (!rois.empty() && !Touches( tile, rois))
+                    {
+                        // Cleared here rather than up front, so every pixel is written once.
+                        target.setTo( cv::Scalar::all( 0));
+                        continue;
+                    }
+                    // The tables hold absolute source coordinates, so every tile reads the whole source.
+                    cv::remap( source, target, m_xy( tile), m_interpolation( tile), cv::INTER_LINEAR, cv::BORDER_CONSTANT);
+                }
+            });
+        }
+
+        // Replaces the frame's image by its undistorted version in a buffer from pool, returns
+        // the old one to the pool and restarts the pyramid on the new image. Must run before
+        // the frame is handed on.
+        void Apply( CFrame& frame, const CMatPool& pool, const std::vector<cv::Rect>& rois = std::vector<cv::Rect>()) const
+        {
+            cv::Mat undistorted = pool.Acquire( m_imageSize, frame.image.type());
+            Apply( frame.image, undistorted, rois);
+            frame.pyramid.Reset( undistorted, pool);
+            pool.Release( frame.image);
+            frame.image = undistorted;
+        }
+
+    private:
+        static bool Touches( const cv::Rect& tile, const std::vector<cv::Rect>& rois)
+        {
+            for (size_t i = 0; i < rois.size(); ++i)
+            {
+                if ((tile & rois[i]).area() > 0)
+                {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        cv::Size m_imageSize;
+        cv::Mat m_xy;
+        cv::Mat m_interpolation;
+    };
+}
+
+#endif /* INCLUDED_UNDISTORTION_H_9026475 */
@@ -0,0 +1,246 @@
+// Contains a work-stealing thread pool for nested, uneven tasks such as batch reprocessing of brackets.
+
+#ifndef INCLUDED_WORKSTEALINGPOOL_H_5530872
+#define INCLUDED_WORKSTEALINGPOOL_H_5530872
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace Pipeline
+{
+    // Every worker owns a deque. Tasks submitted by a worker go to the back of its own deque
+    // and are taken from there (newest first, which keeps a bracket's data in cache); idle
+    // workers steal from the front of the others' deques (oldest first, i.e. the largest
+    // remaining pieces of work). Tasks submitted from outside are spread round robin.
+    // A thread waiting for a task group runs queued tasks meanwhile, so tasks may wait
+    // for their own subtasks without tying up a worker; when nothing is queued it sleeps
+    // until a task is submitted or the group finishes.
+    class CWorkStealingPool
+    {
+    public:
+        explicit CWorkStealingPool( size_t threadCount)
+            : m_queues( threadCount)
+            , m_pending( 0)
+            , m_nextQueue( 0)
+            , m_stopping( false)
+        {
+            for (size_t i = 0; i < threadCount; ++i)
+            {
+                m_queues[i].reset( new SQueue);
+            }
+            for (size_t i = 0; i < threadCount; ++i)
+            {
+                m_threads.push_back( std::thread( &CWorkStealingPool::Run, this, i));
+            }
+        }
+
+        // Finishes all queued tasks before returning.
+        ~CWorkStealingPool()
+        {
+            {
+                std::lock_guard<std::mutex> lock( m_sleepMutex);
+                m_stopping = true;
+            }
+            m_wakeUp.notify_all();
+            for (size_t i = 0; i < m_threads.size(); ++i)
+            {
+                m_threads[i].join();
+            }
+        }
+
+        size_t ThreadCount() const
+        {
+            return m_threads.size();
+        }
+
+        void Submit( const std::function<void()>& task)
+        {
+            const SIdentity& self = Identity();
+            const size_t index = self.pool == this ? self.index : m_nextQueue++ % m_queues.size();
+            {
+                std::lock_guard<std::mutex> lock( m_queues[index]->mutex);
+                m_queues[index]->tasks.push_back( task);
+            }
+            {
+                std::lock_guard<std::mutex> lock( m_sleepMutex);
+                ++m_pending;
+            }
+            m_wakeUp.notify_one();
+        }
+
+        // Runs one queued task on the calling thread. Returns false if there was none.
+        bool RunOne()
+        {
+            const SIdentity& self = Identity();
+            std::function<void()> task;
+            if (!Take( self.pool == this ? self.index : 0, task))
+            {
+                return false;
+            }
+            task();
+            return true;
+        }
+
+        // Sleeps until done() returns true or a task is queued. done is evaluated under the
+        // pool's lock, so whoever makes it true must call NotifyAll afterwards.
+        template <typename TDone>
+        void WaitFor( TDone done)
+        {
+            std::unique_lock<std::mutex> lock( m_sleepMutex);
+            m_wakeUp.wait( lock, [this, &done] { return m_pending > 0 || done(); });
+        }
+
+        void NotifyAll()
+        {
+            {
+                // Orders the caller's change before a waiter's check of done().
+                std::lock_guard<std::mutex> lock( m_sleepMutex);
+            }
+            m_wakeUp.notify_all();
+        }
+
+    private:
+        CWorkStealingPool( const CWorkStealingPool&);
+        CWorkStealingPool& operator=( const CWorkStealingPool&);
+
+        struct SQueue
+        {
+            std::mutex mutex;
+            std::deque<std::function<void()> > tasks;
+        };
+
+        struct SIdentity
+        {
+            CWorkStealingPool* pool;
+            size_t index;
+        };
+
+        static SIdentity& Identity()
+        {
+            static thread_local SIdentity identity = { 0, 0 };
+            return identity;
+        }
+
+        // Pops from the back of the own deque, else steals from the front of another one.
+        bool Take( size_t own, std::function<void()>& task)
+        {
+            for (size_t n = 0; n < m_queues.size(); ++n)
+            {
+                const size_t index = (own + n) % m_queues.size();
+                SQueue& queue = *m_queues[index];
+                std::lock_guard<std::mutex> lock( queue.mutex);
+                if (queue.tasks.empty())
+                {
+                    continue;
+                }
+                if (n == 0)
+                {
+                    task = queue.tasks.back();
+                    queue.tasks.pop_back();
+                }
+                else
+                {
+                    task = queue.tasks.front();
+                    queue.tasks.pop_front();
+                }
+                {
+                    std::lock_guard<std::mutex> sleepLock( m_sleepMutex);
+                    --m_pending;
+                }
+                return true;
+            }
+            return false;
+        }
+
+        void Run( size_t index)
+        {
+            SIdentity& self = Identity();
+            self.pool = this;
+            self.index = index;
+            std::function<void()> task;
+            for (;;)
+            {
+                if (Take( index, task))
+                {
+                    task();
+                    task = nullptr;
+                    continue;
+                }
+                std::unique_lock<std::mutex> lock( m_sleepMutex);
+                m_wakeUp.wait( lock, [this] { return m_stopping || m_pending > 0; });
+                if (m_stopping && m_pending == 0)
+                {
+                    return;
+                }
+            }
+        }
+
+        std::vector<std::unique_ptr<SQueue> > m_queues;
+        std::vector<std::thread> m_threads;
+        std::mutex m_sleepMutex;
+        std::condition_variable m_wakeUp;
+        // Queued but not yet taken tasks, guarded by m_sleepMutex.
+        size_t m_pending;
+        std::atomic<size_t> m_nextQueue;
+        bool m_stopping;
+    };
+
+    // Tracks a set of tasks so that a caller can wait for them. Waiting runs other queued
+    // tasks before it blocks, which makes nesting groups inside tasks safe.
+    class CTaskGroup
+    {
+    public:
+        explicit CTaskGroup( CWorkStealingPool& pool)
+            : m_pool( pool)
+            , m_outstanding( 0)
+        {
+        }
+
+        ~CTaskGroup()
+        {
+            Wait();
+        }
+
+        void Run( const std::function<void()>& task)
+        {
+            m_outstanding.fetch_add( 1);
+            // The group may be gone once the count reaches zero, so only the pool is used after that.
+            std::atomic<size_t>* outstanding = &m_outstanding;
+            CWorkStealingPool* pool = &m_pool;
+            m_pool.Submit( [task, outstanding, pool]()
+            {
+                task();
+                if (outstanding->fetch_sub( 1, std::memory_order_acq_rel) == 1)
+                {
+                    pool->NotifyAll();
+                }
+            });
+        }
+
+        void Wait()
+        {
+            while (m_outstanding.load( std::memory_order_acquire) != 0)
+            {
+                if (!m_pool.RunOne())
+                {
+                    m_pool.WaitFor( [this] { return m_outstanding.load( std::memory_order_acquire) == 0; });
+                }
+            }
+        }
+
+    private:
+        CTaskGroup( const CTaskGroup&);
+        CTaskGroup& operator=( const CTaskGroup&);
+
+        CWorkStealingPool& m_pool;
+        std::atomic<size_t> m_outstanding;
+    };
+}
+
+#endif /* INCLUDED_WORKSTEALINGPOOL_H_5530872 */
@@ -19,6 +19,11 @@
 // Include files used by samples.
 #include "./include/ConfigurationEventPrinter.h"
 #include "./include/ImageEventPrinter.h"
+#include "./include/BatchProcessor.h"
+#include "./include/BracketEventHandler.h"
+#include "./include/DeadlineScheduler.h"
+#include "./include/Metrics.h"
+#include "./include/SharedFramePublisher.h"
 // Namespace for using pylon objects.
 using namespace Pylon;
 #if defined ( USE_GIGE )
@@ -47,12 +52,86 @@ public:
         cout << std::endl;
     }
 };
+// Moves the AOI of every sequence set to aoi (sensor coordinates), rounded to the camera's
+// increments, and returns the AOI actually set. Grabbing must be stopped.
+static cv::Rect ApplyAoi( Camera_t& camera, cv::Rect aoi, int64_t setCount)
+{
+    const int64_t widthMax = camera.WidthMax.GetValue();
+    const int64_t heightMax = camera.HeightMax.GetValue();
+    int64_t width = std::max( camera.Width.GetMin(), (aoi.width + camera.Width.GetInc() - 1) / camera.Width.GetInc() * camera.Width.GetInc());
+    int64_t height = std::max( camera.Height.GetMin(), (aoi.height + camera.Height.GetInc() - 1) / camera.Height.GetInc() * camera.Height.GetInc());
+    width = std::min( width, widthMax);
+    height = std::min( height, heightMax);
+    int64_t offsetX = std::min( (int64_t) aoi.x, widthMax - width) / camera.OffsetX.GetInc() * camera.OffsetX.GetInc();
+    int64_t offsetY = std::min( (int64_t) aoi.y, heightMax - height) / camera.OffsetY.GetInc() * camera.OffsetY.GetInc();
+
+    camera.SequenceEnable.SetValue(false);
+    if (IsWritable(camera.SequenceConfigurationMode))
+    {
+        camera.SequenceConfigurationMode.SetValue(SequenceConfigurationMode_On);
+    }
+    for (int64_t set = 0; set < setCount; ++set)
+    {
+        camera.SequenceSetIndex = set;
+        camera.SequenceSetLoad.Execute();
+        // Shrink the offsets first so that every intermediate AOI is valid.
+        camera.OffsetX.SetValue(camera.OffsetX.GetMin());
+        camera.OffsetY.SetValue(camera.OffsetY.GetMin());
+        camera.Width.SetValue(width);
+        camera.Height.SetValue(height);
+        camera.OffsetX.SetValue(offsetX);
+        camera.OffsetY.SetValue(offsetY);
+        camera.SequenceSetStore.Execute();
+    }
+    if (IsWritable(camera.SequenceConfigurationMode))
+    {
+        camera.SequenceConfigurationMode.SetValue(SequenceConfigurationMode_Off);
+    }
+    camera.SequenceEnable.SetValue(true);
+    return cv::Rect( (int) offsetX, (int) offsetY, (int) width, (int) height);
+}
+
 int main(int argc, char* argv[])
 {
 
     double exp_0 = 3000;
     double exp_1 = exp_0*3;
     double exp_2 = exp_1*3;
+    double cameraGamma = 0.46;
+    // Dark/flat field correction tables and hot/dead pixel map, recorded with the 'd', 'f' and 'c' keys below.
+    const char* flatFieldPath = "frames/flatfield.yml.gz";
+    const char* defectMapPath = "frames/defects.yml.gz";
+    const int calibrationFramesPerSet = 16;
+    // Camera intrinsics from OpenCV's calibration sample; frames are undistorted if the file exists.
+    const char* intrinsicsPath = "frames/intrinsics.yml";
+    // Grabbed frames, radiance maps and fused images are published here for other local processes.
+    const char* sharedFrameRingName = "/basler_frames";
+    const uint32_t sharedFrameSlots = 8;
+    // Per-frame time budget of the grab thread if the camera does not report its frame rate.
+    // The preview is skipped or shown less often when saving leaves no time for it.
+    const double defaultFrameDeadlineMs = 50;
+    // Save only the moving part of each frame. The saved images then vary in size, so batch
+    // mode cannot re-merge those brackets; hence it is off by default. Optionally also shrink
+    // the camera AOI to it, checked every aoiUpdateBrackets brackets. That restarts grabbing,
+    // which may lose the bracket in flight, and suspends the flat field, defect and
+    // undistortion stages, whose tables only cover the full frame.
+    const bool trackRoi = false;
+    const bool trackCameraAoi = false;
+    const int aoiUpdateBrackets = 10;
+
+    // Offline mode: "main --batch <input dir> <output dir> [threads]" re-merges and re-fuses the
+    // recorded brackets below the input directory without touching a camera.
+    if (argc >= 4 && std::string( argv[1]) == "--batch")
+    {
+        Pipeline::SBatchOptions options;
+        options.exposureTimesUs.push_back( exp_0);
+        options.exposureTimesUs.push_back( exp_1);
+        options.exposureTimesUs.push_back( exp_2);
+        options.cameraGamma = cameraGamma;
+        options.threadCount = argc >= 5 ? (size_t) std::max( 0, atoi( argv[4])) : 0;
+        Pipeline::CBatchProcessor batch( options);
+        return batch.Run( argv[2], argv[3]) == 0 ? 0 : 1;
+    }
 
     // The exit code of the sample application.
     int exitCode = 0;
@@ -60,6 +139,11 @@ int main(int argc, char* argv[])
     PylonInitialize();
     try
     {
+        // Dump the grab pipeline counters and latencies once per second for scraping.
+        Pipeline::CMetricsSnapshotWriter metricsWriter( "metrics.prom", Pipeline::MetricsFormat_Prometheus, std::chrono::milliseconds( 1000));
+        // Declared before the camera so that it outlives the handlers that publish into it.
+        std::unique_ptr<Pipeline::CSharedFramePublisher> sharedFrames;
+        Pipeline::CDeadlineScheduler grabScheduler( (uint64_t) (defaultFrameDeadlineMs * 1e6));
         // Only look for cameras supported by Camera_t.
         // GiGe camerayı aradı buldu
         CDeviceInfo info;
@@ -79,7 +163,37 @@ int main(int argc, char* argv[])
         // The image event printer serves as sample image processing.
         // When using the grab loop thread provided by the Instant Camera object, an image event handler processing the grab
         // results must be created and registered.
-        camera.RegisterImageEventHandler( new CImageEventPrinter, RegistrationMode_Append, Cleanup_Delete);
+        // It receives the pooled frame copies from the bracket handler below and saves and displays them.
+        CImageEventPrinter* pImageEventPrinter = new CImageEventPrinter;
+        pImageEventPrinter->SetScheduler( &grabScheduler);
+        // Idle line: do not save frames that look like the last saved one of their sequence set.
+        pImageEventPrinter->EnableChangeDetection();
+        if (trackRoi)
+        {
+            pImageEventPrinter->EnableRoiTracking();
+        }
+        camera.RegisterImageEventHandler( pImageEventPrinter, RegistrationMode_Append, Cleanup_Delete);
+        // Collect the three sequencer exposures into a bracket, merge them into a half-float radiance map
+        // and fuse them into one well-exposed image.
+        std::vector<double> exposureTimes;
+        exposureTimes.push_back( exp_0);
+        exposureTimes.push_back( exp_1);
+        exposureTimes.push_back( exp_2);
+        CBracketEventHandler* pBracketEventHandler = new CBracketEventHandler( exposureTimes, cameraGamma);
+        pBracketEventHandler->AddFrameConsumer( pImageEventPrinter);
+        if (pBracketEventHandler->LoadFlatField( flatFieldPath))
+        {
+            cerr << "Loaded flat field correction from " << flatFieldPath << endl;
+        }
+        if (pBracketEventHandler->LoadDefectMap( defectMapPath))
+        {
+            cerr << "Loaded defect pixel map from " << defectMapPath << endl;
+        }
+        if (pBracketEventHandler->LoadUndistortion( intrinsicsPath))
+        {
+            cerr << "Undistorting frames with the intrinsics from " << intrinsicsPath << endl;
+        }
+        camera.RegisterImageEventHandler( pBracketEventHandler, RegistrationMode_Append, Cleanup_Delete);
         // For demonstration purposes only, register another image event handler.
         camera.RegisterImageEventHandler( new CSampleImageEventHandler, RegistrationMode_Append, Cleanup_Delete);
         // Open the camera device.
@@ -92,7 +206,7 @@ int main(int argc, char* argv[])
             {
 
                 camera.GammaEnable.SetValue(true);
-                camera.Gamma.SetValue(0.46); 
+                camera.Gamma.SetValue(cameraGamma);
 
                 // Disable the sequencer before changing parameters.
                 // The parameters under control of the sequencer are locked
@@ -151,12 +265,51 @@ int main(int argc, char* argv[])
                 // From here on you cannot change the sequencer settings anymore.
                 camera.SequenceEnable.SetValue(true);
 
+                // Tag every frame with its sequence set, so that a frame lost in transport does not
+                // shift the set of all following frames. Without the chunk the set is counted.
+                if (IsWritable(camera.ChunkModeActive) && IsAvailable(camera.ChunkSelector.GetEntry(ChunkSelector_SequenceSetIndex)))
+                {
+                    camera.ChunkModeActive.SetValue(true);
+                    camera.ChunkSelector.SetValue(ChunkSelector_SequenceSetIndex);
+                    camera.ChunkEnable.SetValue(true);
+                }
+                else
+                {
+                    cerr << "The camera does not report sequence sets; counting frames instead." << endl;
+                }
+
+                // Give every frame the time until the next one arrives.
+                if (IsReadable(camera.ResultingFrameRateAbs) && camera.ResultingFrameRateAbs.GetValue() > 0)
+                {
+                    grabScheduler.SetFrameDeadline( (uint64_t) (1e9 / camera.ResultingFrameRateAbs.GetValue()));
+                }
+                pBracketEventHandler->SetScheduler( &grabScheduler);
+
+                // The largest frame in the ring is the half-float radiance map.
+                try
+                {
+                    sharedFrames.reset( new Pipeline::CSharedFramePublisher( sharedFrameRingName, sharedFrameSlots,
+                        (uint64_t) camera.Width.GetValue() * camera.Height.GetValue() * sizeof( uint16_t)));
+                    pBracketEventHandler->AddFrameConsumer( sharedFrames.get());
+                    pBracketEventHandler->SetSharedFramePublisher( sharedFrames.get());
+                    cerr << "Publishing frames to shared memory " << sharedFrameRingName << endl;
+                }
+                catch (const std::exception& e)
+                {
+                    cerr << "Frames are not shared: " << e.what() << endl;
+                }
+
                 // Start the grabbing using the grab loop thread, by setting the grabLoopType parameter
                 // to GrabLoop_ProvidedByInstantCamera. The grab results are delivered to the image event handlers.
                 // The GrabStrategy_OneByOne default grab strategy is used.
                 camera.StartGrabbing( GrabStrategy_OneByOne, GrabLoop_ProvidedByInstantCamera);
+                const cv::Rect sensor( 0, 0, (int) camera.WidthMax.GetValue(), (int) camera.HeightMax.GetValue());
+                cv::Rect cameraAoi( (int) camera.OffsetX.GetValue(), (int) camera.OffsetY.GetValue(), (int) camera.Width.GetValue(), (int) camera.Height.GetValue());
+                uint64_t triggerCount = 0;
         
                 cerr << endl << "Enter \"t\" to trigger the camera or \"e\" to exit and press enter? (t/e)" << endl << endl;
+                cerr << "Calibration: \"d\" records dark frames (lens covered), \"f\" records flat frames (uniform target)," << endl
+                     << "\"c\" computes, saves and applies the correction and the hot/dead pixel map." << endl << endl;
         
                 // Wait for user input to trigger the camera or exit the program.
                 // The grabbing is stopped, the device is closed and destroyed automatically when the camera object goes out of scope.
@@ -167,13 +320,60 @@ int main(int argc, char* argv[])
                     //if ( (key == 't' || key == 'T'))
                     //{
                         // Execute the software trigger. Wait up to 500 ms for the camera to be ready for trigger.
+                        uint64_t waitStartNs = Pipeline::NowNs();
                         if ( camera.WaitForFrameTriggerReady( 500, TimeoutHandling_ThrowException))
                         {
+                            Pipeline::GetMetrics().Record( Pipeline::Histogram_TriggerWait, Pipeline::NowNs() - waitStartNs);
                             camera.ExecuteSoftwareTrigger();
+                            ++triggerCount;
                         }
+                        // Only between brackets, so the sequencer restarts at set 0 with nothing pending.
+                        if (trackRoi && trackCameraAoi && triggerCount > 0 && triggerCount % (camera.SequenceSetTotalNumber.GetValue() * aoiUpdateBrackets) == 0)
+                        {
+                            cv::Rect region = pImageEventPrinter->TakeTrackedRegion();
+                            if (region.area() > 0)
+                            {
+                                region += cameraAoi.tl();
+                                // Motion at the AOI border may continue outside it: go back to the full sensor.
+                                const bool atBorder = region.x <= cameraAoi.x || region.y <= cameraAoi.y
+                                    || region.br().x >= cameraAoi.br().x || region.br().y >= cameraAoi.br().y;
+                                const cv::Rect target = atBorder ? sensor : region;
+                                if (target != cameraAoi && std::abs( target.area() - cameraAoi.area()) > cameraAoi.area() / 4)
+                                {
+                                    camera.StopGrabbing();
+                                    cameraAoi = ApplyAoi( camera, target, camera.SequenceSetTotalNumber.GetValue());
+                                    pBracketEventHandler->ResetSequence();
+                                    camera.StartGrabbing( GrabStrategy_OneByOne, GrabLoop_ProvidedByInstantCamera);
+                                    cerr << "Camera AOI moved to " << cameraAoi << endl;
+                                }
+                            }
+                        }
+                        Pipeline::GetMetrics().Set( Pipeline::Gauge_ReadyBuffers, camera.NumReadyBuffers.GetValue());
+                        Pipeline::GetMetrics().Set( Pipeline::Gauge_QueuedBuffers, camera.NumQueuedBuffers.GetValue());
                     //}
                     //cin.get(key);
                     key = (char) cv::waitKey(5);
+                    if (key == 'd' || key == 'D' || key == 'f' || key == 'F')
+                    {
+                        bool dark = key == 'd' || key == 'D';
+                        pBracketEventHandler->StartCalibration( dark ? Pipeline::CalibrationMode_Dark : Pipeline::CalibrationMode_Flat, calibrationFramesPerSet);
+                        cerr << "Recording " << calibrationFramesPerSet << (dark ? " dark" : " flat") << " frames per sequence set." << endl;
+                    }
+                    else if (key == 'c' || key == 'C')
+                    {
+                        if (pBracketEventHandler->IsCalibrating())
+                        {
+                            cerr << "Calibration frames are still being recorded." << endl;
+                        }
+                        else if (pBracketEventHandler->FinishCalibration( flatFieldPath, defectMapPath))
+                        {
+                            cerr << "Flat field correction and defect pixel map saved to " << flatFieldPath << " and " << defectMapPath << " and applied." << endl;
+                        }
+                        else
+                        {
+                            cerr << "Could not build or save the flat field correction and defect pixel map; record dark and flat frames at the same AOI." << endl;
+                        }
+                    }
                 }
                 while ( (key != 'e') && (key != 'E'));
 
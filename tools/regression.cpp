@@ -0,0 +1,311 @@
+// regression.cpp
+/*
+    Runs the linearization, HDR merge and exposure fusion stages on the reference bracket in
+    frames/1, checks the results and times every stage.
+
+    - The linearization of the gamma images in "doğru sonuc gamma" is compared with the
+      known-correct linear images in "dogru sonuc linear" (see test.m). Those were grabbed
+      separately and the scene moved in between, so the check compares tone curves: for every
+      grey level, the median linear value of the pixels that have it in the gamma image.
+    - The merged radiance map and the fused image are compared with golden results in
+      frames/1/golden, which --update (re)writes from the current build.
+
+    Build with "make regression" and run from the repository root:
+        tools/regression [--update] [--iterations n] [--gamma g] [--bracket dir]
+    Exits with 1 if any comparison is outside its tolerance.
+*/
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <sys/stat.h>
+#include "opencv2/opencv.hpp"
+#include "../include/ExposureFusion.h"
+#include "../include/Frame.h"
+#include "../include/HalfFloat.h"
+#include "../include/HdrMerge.h"
+#include "../include/Metrics.h"
+
+using namespace Pipeline;
+
+namespace
+{
+    // Exposure times of the three sequence sets in main.cpp, in image_<set>.jpg order.
+    const double c_exposureTimesUs[] = { 3000, 9000, 27000 };
+    const int c_setCount = 3;
+
+    struct SOptions
+    {
+        SOptions()
+            : update( false)
+            , iterations( 10)
+            // test.m raises the gamma images to the power 2.2.
+            , cameraGamma( 1.0 / 2.2)
+            , bracketDirectory( "frames/1")
+            // Grey levels need this many pixels for their median to count.
+            , linearMinimumPixels( 500)
+            // Observed: 1.17, 0.75 and 2.11 for image_0..2.
+            , linearMeanTolerance( 3.0)
+            , radianceRelativeTolerance( 0.005)
+            , fusedMeanTolerance( 0.5)
+            , fusedMaxTolerance( 4.0)
+        {
+        }
+
+        bool update;
+        int iterations;
+        double cameraGamma;
+        std::string bracketDirectory;
+        int linearMinimumPixels;
+        double linearMeanTolerance;
+        double radianceRelativeTolerance;
+        double fusedMeanTolerance;
+        double fusedMaxTolerance;
+    };
+
+    // Median and minimum wall time of a stage over all iterations.
+    struct STiming
+    {
+        const char* stage;
+        double medianMs;
+        double minMs;
+    };
+
+    template <typename TStage>
+    STiming Time( const char* stage, int iterations, TStage run)
+    {
+        std::vector<double> samples( iterations);
+        for (int i = 0; i < iterations; ++i)
+        {
+            const uint64_t start = NowNs();
+            run();
+            samples[i] = (NowNs() - start) / 1e6;
+        }
+        std::sort( samples.begin(), samples.end());
+        STiming timing = { stage, samples[samples.size() / 2], samples.front() };
+        return timing;
+    }
+
+    bool Check( const char* what, double value, double tolerance)
+    {
+        const bool ok = value <= tolerance;
+        std::printf( "%-36s %10.4f  (tolerance %g)  %s\n", what, value, tolerance, ok ? "ok" : "FAILED");
+        return ok;
+    }
+
+    // Mean over the grey levels z of the gamma image that occur at least minimumPixels times of
+    // |median of linear where gamma == z - expected[z]|.
+    double ToneCurveDeviation( const cv::Mat& gamma, const cv::Mat& linear, const float* expected, int minimumPixels)
+    {
+        std::vector<int> histogram( 256 * 256, 0);
+        for (int y = 0; y < gamma.rows; ++y)
+        {
+            const uint8_t* g = gamma.ptr<uint8_t>( y);
+            const uint8_t* l = linear.ptr<uint8_t>( y);
+            for (int x = 0; x < gamma.cols; ++x)
+            {
+                ++histogram[g[x] * 256 + l[x]];
+            }
+        }
+        double sum = 0;
+        int levels = 0;
+        for (int z = 0; z < 256; ++z)
+        {
+            const int* counts = &histogram[z * 256];
+            int total = 0;
+            for (int v = 0; v < 256; ++v)
+            {
+                total += counts[v];
+            }
+            if (total < minimumPixels)
+            {
+                continue;
+            }
+            int median = 0;
+            for (int seen = counts[0]; 2 * seen < total; seen += counts[++median])
+            {
+            }
+            sum += std::fabs( median - expected[z]);
+            ++levels;
+        }
+        return levels ? sum / levels : 0.0;
+    }
+
+    cv::Mat HalfToFloatImage( const cv::Mat& half)
+    {
+        cv::Mat result( half.size(), CV_32FC1);
+        for (int y = 0; y < half.rows; ++y)
+        {
+            const uint16_t* source = half.ptr<uint16_t>( y);
+            float* destination = result.ptr<float>( y);
+            for (int x = 0; x < half.cols; ++x)
+            {
+                destination[x] = HalfToFloat( source[x]);
+            }
+        }
+        return result;
+    }
+
+    // Mean of |a - b| / max(|b|, floor): relative where the golden is bright, absolute in the dark.
+    double MeanRelativeError( const cv::Mat& a, const cv::Mat& b, float floor)
+    {
+        double sum = 0;
+        for (int y = 0; y < a.rows; ++y)
+        {
+            const float* pa = a.ptr<float>( y);
+            const float* pb = b.ptr<float>( y);
+            for (int x = 0; x < a.cols; ++x)
+            {
+                sum += std::fabs( pa[x] - pb[x]) / std::max( std::fabs( pb[x]), floor);
+            }
+        }
+        return sum / a.total();
+    }
+
+    bool ParseOptions( int argc, char* argv[], SOptions& options)
+    {
+        for (int i = 1; i < argc; ++i)
+        {
+            const bool hasValue = i + 1 < argc;
+            if (std::strcmp( argv[i], "--update") == 0)
+            {
+                options.update = true;
+            }
+            else if (std::strcmp( argv[i], "--iterations") == 0 && hasValue)
+            {
+                options.iterations = std::max( 1, std::atoi( argv[++i]));
+            }
+            else if (std::strcmp( argv[i], "--gamma") == 0 && hasValue)
+            {
+                options.cameraGamma = std::atof( argv[++i]);
+            }
+            else if (std::strcmp( argv[i], "--bracket") == 0 && hasValue)
+            {
+                options.bracketDirectory = argv[++i];
+            }
+            else
+            {
+                std::fprintf( stderr, "Usage: %s [--update] [--iterations n] [--gamma g] [--bracket dir]\n", argv[0]);
+                return false;
+            }
+        }
+        return true;
+    }
+}
+
+int main( int argc, char* argv[])
+{
+    SOptions options;
+    if (!ParseOptions( argc, argv, options))
+    {
+        return 2;
+    }
+    const std::string gammaDirectory = options.bracketDirectory + "/do\xc4\x9fru sonuc gamma";
+    const std::string linearDirectory = options.bracketDirectory + "/dogru sonuc linear";
+    const std::string goldenDirectory = options.bracketDirectory + "/golden";
+
+    // The references were saved as 3-channel JPEGs of Mono8 frames.
+    CMatPool pool;
+    CBracket bracket;
+    std::vector<cv::Mat> linearReferences;
+    for (int set = 0; set < c_setCount; ++set)
+    {
+        const std::string name = "/image_" + std::to_string( set) + ".jpg";
+        cv::Mat gamma = cv::imread( gammaDirectory + name, cv::IMREAD_GRAYSCALE);
+        cv::Mat linear = cv::imread( linearDirectory + name, cv::IMREAD_GRAYSCALE);
+        if (gamma.empty() || linear.empty() || gamma.size() != linear.size())
+        {
+            std::fprintf( stderr, "Could not read the reference bracket %s from %s.\n", name.c_str(), options.bracketDirectory.c_str());
+            return 2;
+        }
+        CFramePtr frame = WrapFrame( gamma, pool);
+        frame->setIndex = set;
+        frame->exposureUs = c_exposureTimesUs[set];
+        bracket.push_back( frame);
+        linearReferences.push_back( linear);
+    }
+
+    CHdrMerge merge( options.cameraGamma);
+    CExposureFusion fusion;
+    cv::Mat radiance;
+    cv::Mat fused;
+    std::vector<STiming> timings;
+
+    // Linearization is folded into the merge's tables; as a stage of its own it is a lookup
+    // table applied to each frame.
+    float expected[256];
+    cv::Mat lookUpTable( 1, 256, CV_8UC1);
+    for (int z = 0; z < 256; ++z)
+    {
+        expected[z] = merge.Linearize( (uint8_t) z) * 255.0f;
+        lookUpTable.at<uint8_t>( 0, z) = cv::saturate_cast<uint8_t>( expected[z]);
+    }
+    std::vector<cv::Mat> linear( c_setCount);
+    timings.push_back( Time( "linearize", options.iterations, [&]()
+    {
+        for (int set = 0; set < c_setCount; ++set)
+        {
+            cv::LUT( bracket[set]->image, lookUpTable, linear[set]);
+        }
+    }));
+    timings.push_back( Time( "merge", options.iterations, [&]()
+    {
+        merge.Merge( bracket, radiance);
+    }));
+    // The pyramids are cached in the frames; start them over so every iteration pays for them.
+    timings.push_back( Time( "fusion", options.iterations, [&]()
+    {
+        for (int set = 0; set < c_setCount; ++set)
+        {
+            bracket[set]->pyramid.Reset( bracket[set]->image, pool);
+        }
+        fusion.Fuse( bracket, fused);
+    }));
+
+    // Check the tone curve itself rather than the rounded table.
+    bool ok = true;
+    for (int set = 0; set < c_setCount; ++set)
+    {
+        const std::string what = "linear image_" + std::to_string( set) + " tone curve deviation";
+        ok = Check( what.c_str(), ToneCurveDeviation( bracket[set]->image, linearReferences[set], expected, options.linearMinimumPixels), options.linearMeanTolerance) && ok;
+    }
+
+    // 16-bit PNG stores the half-float bits losslessly.
+    const std::string radiancePath = goldenDirectory + "/radiance_half.png";
+    const std::string fusedPath = goldenDirectory + "/fused.png";
+    if (options.update)
+    {
+        mkdir( goldenDirectory.c_str(), 0755);
+        if (!cv::imwrite( radiancePath, radiance) || !cv::imwrite( fusedPath, fused))
+        {
+            std::fprintf( stderr, "Could not write the golden results to %s.\n", goldenDirectory.c_str());
+            return 2;
+        }
+        std::printf( "Golden results written to %s\n", goldenDirectory.c_str());
+    }
+    else
+    {
+        const cv::Mat goldenRadiance = cv::imread( radiancePath, cv::IMREAD_UNCHANGED);
+        const cv::Mat goldenFused = cv::imread( fusedPath, cv::IMREAD_UNCHANGED);
+        if (goldenRadiance.size() != radiance.size() || goldenRadiance.type() != CV_16UC1
+            || goldenFused.size() != fused.size() || goldenFused.type() != fused.type())
+        {
+            std::fprintf( stderr, "No matching golden results in %s; run with --update to create them.\n", goldenDirectory.c_str());
+            return 1;
+        }
+        // Radiance is relative to the shortest exposure; below 1/64 compare absolutely.
+        ok = Check( "radiance mean relative error", MeanRelativeError( HalfToFloatImage( radiance), HalfToFloatImage( goldenRadiance), 1.0f / 64), options.radianceRelativeTolerance) && ok;
+        ok = Check( "fused mean abs error", cv::norm( fused, goldenFused, cv::NORM_L1) / fused.total() / fused.channels(), options.fusedMeanTolerance) && ok;
+        ok = Check( "fused max abs error", cv::norm( fused, goldenFused, cv::NORM_INF), options.fusedMaxTolerance) && ok;
+    }
+
+    std::printf( "\n%-12s %12s %12s   (%d iterations, %dx%d)\n", "stage", "median ms", "min ms", options.iterations, radiance.cols, radiance.rows);
+    for (size_t i = 0; i < timings.size(); ++i)
+    {
+        std::printf( "%-12s %12.3f %12.3f\n", timings[i].stage, timings[i].medianMs, timings[i].minMs);
+    }
+    return ok ? 0 : 1;
+}